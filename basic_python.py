@@ -3,12 +3,17 @@
 # Matt Keeter, 2025
 
 
+import sys
 import numpy as np
 
-with open('prospero.vm') as f:
+# python3 basic_python.py [file.vm [size [out.ppm]]], make check makes its golden images this way
+filename = sys.argv[1] if len(sys.argv) > 1 else 'prospero.vm'
+image_size = int(sys.argv[2]) if len(sys.argv) > 2 else 1024
+outfile = sys.argv[3] if len(sys.argv) > 3 else 'out.ppm'
+
+with open(filename) as f:
     text = f.read().strip()
 
-image_size = 1024
 space = np.linspace(-1, 1, image_size)
 (x, y) = np.meshgrid(space, -space)
 v = {}
@@ -32,7 +37,7 @@ for line in text.split('\n'):
         case _: raise Exception(f"unknown opcode '{op}'")
 out = v[out]
 
-with open('out.ppm', 'wb') as f: # write the image out
+with open(outfile, 'wb') as f: # write the image out
     f.write(f'P5\n{image_size} {image_size}\n255\n'.encode())
     f.write(((out < 0) * 255).astype(np.uint8).tobytes())
 
@@ -0,0 +1,242 @@
+/*
+ * bench.c
+ *
+ * Benchmark driver for libmachine. Sweeps image size, thread count and evaluator, 
+ * and writes one line of CSV per combination, so runs on different commits can be 
+ * lined up against each other. OPTIMIZE, FUSE, PACKED and INTERVAL_CULL are compile 
+ * time, make bench and make bench-dispatch build this once for each setting they 
+ * sweep and run them all into the same file.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define MAX_SWEEP 32
+
+enum variant {VARIANT_DOUBLE, VARIANT_FLOAT, VARIANT_MIXED, VARIANT_JIT};
+const char *variant_names[] = {"double", "float", "mixed", "jit"};
+
+
+/* Parse a comma separated list of numbers into out, returns how many. */
+int parse_list(const char *arg, int *out) {
+	int n = 0;
+	const char *p = arg;
+	while (*p && (n < MAX_SWEEP)) {
+		char *end;
+		out[n++] = (int) strtol(p, &end, 10);
+		if (end == p) {
+			fprintf(stderr, "Bad number in list: %s\n", arg);
+			exit(1);
+		}
+		p = (*end == ',') ? end + 1 : end;
+	}
+	return n;
+}
+
+
+/* Parse a comma separated list of variant names into out, returns how many. */
+int parse_variants(const char *arg, int *out) {
+	int n = 0;
+	char buf[256];
+	strncpy(buf, arg, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	for (char *tok = strtok(buf, ","); tok && (n < MAX_SWEEP); tok = strtok((char *)0, ",")) {
+		int v;
+		for (v = 0; v <= VARIANT_JIT; v++) {
+			if (strcmp(tok, variant_names[v]) == 0) break;
+		}
+		if (v > VARIANT_JIT) {
+			fprintf(stderr, "Unknown variant: %s\n", tok);
+			exit(1);
+		}
+		out[n++] = v;
+	}
+	return n;
+}
+
+
+double seconds(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) + ((end->tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+
+int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+double median(double *v, int n) {
+	qsort(v, n, sizeof(double), compare_double);
+	return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2.0;
+}
+
+
+/* Sample variance, 0 for a single run. */
+double variance(const double *v, int n) {
+	double mean = 0.0, sum = 0.0;
+	if (n < 2) return 0.0;
+	for (int i = 0; i < n; i++) mean += v[i];
+	mean /= n;
+	for (int i = 0; i < n; i++) sum += (v[i] - mean) * (v[i] - mean);
+	return sum / (n - 1);
+}
+
+
+/* Run the sweep. Options:
+ *   -f  the function to render (default FILENAME)
+ *   -s  image sizes, comma separated (default 512,1024)
+ *   -t  thread counts, comma separated, 0 for none (default 0,NUM_THREADS)
+ *   -v  evaluators: double, float, mixed, jit (default all of them)
+ *   -r  timed runs per combination (default 5)
+ *   -w  untimed warmup runs per combination (default 1)
+ *   -l  label for the label column, a commit hash say (default none)
+ *   -o  file to append CSV to, the header goes in if it's empty (default stdout) */
+int main(int argc, char **argv) {
+	int sizes[MAX_SWEEP], threads[MAX_SWEEP], variants[MAX_SWEEP];
+	int nsizes, nthreads, nvariants;
+	int repeats = 5, warmup = 1, opt;
+	const char *filename = FILENAME;
+	const char *label = "";
+	const char *outfile = (const char *)0;
+	FILE *out = stdout;
+
+	nsizes = parse_list("512,1024", sizes);
+	threads[0] = 0;
+	threads[1] = NUM_THREADS;
+	nthreads = NUM_THREADS ? 2 : 1;
+	nvariants = parse_variants("double,float,mixed,jit", variants);
+
+	while ((opt = getopt(argc, argv, "f:s:t:v:r:w:l:o:")) != -1) {
+		switch (opt) {
+			case 'f': filename = optarg; break;
+			case 's': nsizes = parse_list(optarg, sizes); break;
+			case 't': nthreads = parse_list(optarg, threads); break;
+			case 'v': nvariants = parse_variants(optarg, variants); break;
+			case 'r': repeats = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 'l': label = optarg; break;
+			case 'o': outfile = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-f file] [-s sizes] [-t threads] [-v variants] [-r repeats] [-w warmup] [-l label] [-o outfile]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (repeats < 1) repeats = 1;
+	for (int i = 0; i < nsizes; i++) {
+		if (sizes[i] < 1) {
+			fprintf(stderr, "Sizes must be positive.\n");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < nthreads; i++) {
+		if (threads[i] < 0) {
+			fprintf(stderr, "Thread counts can't be negative.\n");
+			exit(1);
+		}
+	}
+
+	if (outfile) {
+		out = fopen(outfile, "a");
+		if (!out) {
+			fprintf(stderr, "Unable to open %s for writing\n", outfile);
+			exit(1);
+		}
+		fseek(out, 0, SEEK_END);
+	}
+	if (ftell(out) <= 0) {
+		fprintf(out, "label,optimize,fuse,packed,interval_cull,variant,size,threads,repeats,"
+				"wall_median,wall_variance,cpu_median,cpu_variance,pixels_per_sec,peak_rss_kb\n");
+	}
+
+	func *sdf = load_func(filename, 0);
+	jit_code *jit = (jit_code *)0;
+	for (int v = 0; v < nvariants; v++) {
+		if ((variants[v] == VARIANT_JIT) && !JIT_REACHES_PIXELS) {
+			// It would only time the interpreter and call it the JIT.
+			fprintf(stderr, "The JIT never gets to pixels with INTERVAL_CULL and SIMPLIFY_TAPE, skipping the jit variant.\n");
+			break;
+		}
+		if ((variants[v] == VARIANT_JIT) && !jit) {
+			jit = jit_compile(sdf);
+			if (!jit) {
+				fprintf(stderr, "JIT unavailable, skipping the jit variant.\n");
+				break;
+			}
+		}
+	}
+
+	double *wall = (double *) malloc(sizeof(double) * repeats);
+	double *cpu = (double *) malloc(sizeof(double) * repeats);
+	if (!(wall && cpu)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+
+	for (int t = 0; t < nthreads; t++) {
+		renderer *r = create_pinned_renderer(threads[t]);
+		for (int s = 0; s < nsizes; s++) {
+			int size = sizes[s];
+			char *data = (char *)0;
+			if (posix_memalign((void **) &data, 64, (long) size * size)) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(1);
+			}
+			viewport view = {0.0, 0.0, 1.0};
+
+			for (int v = 0; v < nvariants; v++) {
+				int precision = PRECISION_DOUBLE;
+				if (variants[v] == VARIANT_FLOAT) precision = PRECISION_FLOAT;
+				if (variants[v] == VARIANT_MIXED) precision = PRECISION_MIXED;
+				if (variants[v] == VARIANT_JIT) {
+					if (!jit) continue;
+					sdf->jit = jit;
+				}
+
+				for (int i = 0; i < warmup; i++) {
+					render_view(r, sdf, &view, size, size, precision, data);
+				}
+				for (int i = 0; i < repeats; i++) {
+					struct timespec wall_start, wall_end, cpu_start, cpu_end;
+					clock_gettime(CLOCK_MONOTONIC, &wall_start);
+					clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+					render_view(r, sdf, &view, size, size, precision, data);
+					clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+					clock_gettime(CLOCK_MONOTONIC, &wall_end);
+					wall[i] = seconds(&wall_start, &wall_end);
+					cpu[i] = seconds(&cpu_start, &cpu_end);
+				}
+				sdf->jit = (jit_code *)0;
+
+				// Peak for the whole process so far, the biggest image yet is what sets it.
+				struct rusage usage;
+				getrusage(RUSAGE_SELF, &usage);
+
+				double wall_var = variance(wall, repeats), cpu_var = variance(cpu, repeats);
+				double wall_med = median(wall, repeats), cpu_med = median(cpu, repeats);
+				fprintf(out, "%s,%d,%d,%d,%d,%s,%d,%d,%d,%.6f,%.3e,%.6f,%.3e,%.0f,%ld\n",
+						label, OPTIMIZE, FUSE, PACKED, INTERVAL_CULL, variant_names[variants[v]], size, threads[t], repeats,
+						wall_med, wall_var, cpu_med, cpu_var, ((double) size * size) / wall_med, usage.ru_maxrss);
+				fflush(out);
+			}
+			free(data);
+		}
+		free_renderer(r);
+	}
+
+	free(wall);
+	free(cpu);
+	sdf->jit = jit;
+	free_func(sdf);
+	if (outfile) fclose(out);
+	return 0;
+}
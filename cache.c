@@ -0,0 +1,191 @@
+/*
+ * cache.c
+ *
+ * Compiled tapes for the Prospero Challenge renderer. A func that has been through
+ * the passes is written out as it sits in memory, so the next run can map it straight
+ * back in instead of parsing and optimizing the text all over again. load_func keeps
+ * one of these for every .vm file it sees, named for a hash of the file's contents.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TAPE_MAGIC "PROSPTAP"
+#define TAPE_VERSION 3
+#define TAPE_ENDIAN 0x01020304
+#define TAPE_ALIGN 64
+
+// Laid out at the start of the file, the tape follows at a TAPE_ALIGN boundary.
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;	// TAPE_ENDIAN as the writer saw it
+	uint64_t source;	// hash of the .vm it came from
+	uint32_t options;	// tape_options() of the writer
+	int32_t size;
+	int32_t slots;
+	uint64_t func_offset;
+	uint64_t file_size;
+} tape_header;
+
+
+/* The passes and types that decide what a tape looks like. A tape written with
+ * different ones is no good to us. */
+static uint32_t tape_options(void) {
+	return (OPTIMIZE ? 1 : 0) | (IMMEDIATES ? 2 : 0) | (REGISTER_ALLOC ? 4 : 0) | (FUSE ? 8 : 0)
+		| (sizeof(fp_type) << 8) | (sizeof(operation) << 16);
+}
+
+
+static uint64_t align_up(uint64_t offset) {
+	return (offset + TAPE_ALIGN - 1) & ~((uint64_t) TAPE_ALIGN - 1);
+}
+
+
+/* FNV-1a over the contents of filename, into hash. Opened without blocking, so a FIFO
+ * can't hang the caller, and anything that isn't a regular file is turned away.
+ * Returns 1, or 0 if it couldn't be read. */
+int hash_file(const char *filename, uint64_t *hash) {
+	struct stat st;
+	*hash = 0xcbf29ce484222325ULL;
+	int fd = open(filename, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return 0;
+	}
+	if (st.st_size > 0) {
+		const unsigned char *data = (const unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == (const unsigned char *) MAP_FAILED) {
+			close(fd);
+			return 0;
+		}
+		for (off_t i = 0; i < st.st_size; i++) {
+			*hash = (*hash ^ data[i]) * 0x100000001b3ULL;
+		}
+		munmap((void *) data, st.st_size);
+	}
+	close(fd);
+	return 1;
+}
+
+
+/* Where the cached tape for a source with this hash lives. */
+int tape_cache_path(char *path, size_t len, uint64_t source) {
+	return snprintf(path, len, "%s/%016llx-%08x.tape", TAPE_CACHE_DIR, (unsigned long long) source, tape_options());
+}
+
+
+/* Write sdf to filename as a tape, noting the hash of the source it came from.
+ * Written to a temporary file and renamed into place, so a reader never sees half
+ * of one. Returns 1 on success. */
+int write_tape(const char *filename, func *sdf, uint64_t source) {
+	tape_header header;
+	char tmpname[4096];
+	static const char zeros[TAPE_ALIGN] = {0};
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TAPE_MAGIC, 8);
+	header.version = TAPE_VERSION;
+	header.endian = TAPE_ENDIAN;
+	header.source = source;
+	header.options = tape_options();
+	header.size = sdf->size;
+	header.slots = sdf->slots;
+	header.func_offset = align_up(sizeof(header));
+	header.file_size = header.func_offset + sizeof(operation) * header.size;
+
+	if (snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", filename, (int) getpid()) >= (int) sizeof(tmpname)) return 0;
+	FILE *fp = fopen(tmpname, "wb");
+	if (!fp) return 0;
+	size_t pad = header.func_offset - sizeof(header);
+	int ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+	if (pad) ok = ok && (fwrite(zeros, pad, 1, fp) == 1);
+	ok = ok && (fwrite(sdf->func, sizeof(operation), header.size, fp) == (size_t) header.size);
+	ok = (fclose(fp) == 0) && ok;
+	if (ok) ok = (rename(tmpname, filename) == 0);
+	if (!ok) unlink(tmpname);
+	return ok;
+}
+
+
+/* Map the tape in filename into out. With a source hash, only a tape made from that
+ * source will do, and anything else quietly isn't loaded. Without one, say what's
+ * wrong with the file.
+ * Returns 1 if it loaded, 0 if it's a tape we can't use, -1 if it's not a tape at all. */
+int load_tape(const char *filename, func *out, uint64_t source) {
+	tape_header header;
+	struct stat st;
+	const char *why = (const char *)0;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) || (st.st_size < (off_t) sizeof(header))
+			|| (read(fd, &header, sizeof(header)) != sizeof(header))
+			|| memcmp(header.magic, TAPE_MAGIC, 8)) {
+		close(fd);
+		return -1;
+	}
+
+	if (header.endian != TAPE_ENDIAN) why = "written on a machine of the other endianness";
+	else if (header.version != TAPE_VERSION) why = "written by a different version";
+	else if (header.options != tape_options()) why = "built with different options in machine.h";
+	else if (source && (header.source != source)) why = "made from a different source";
+	else if ((header.file_size != (uint64_t) st.st_size) || (header.size < 1)
+			|| (header.slots < 1) || (header.slots > PARSE_MAX_NAME + 1)
+			|| (header.func_offset + sizeof(operation) * header.size > header.file_size)
+			|| (header.func_offset % TAPE_ALIGN)) {
+		why = "truncated or damaged";
+	}
+	if (why) {
+		if (!source) fprintf(stderr, "%s: tape %s\n", filename, why);
+		close(fd);
+		return 0;
+	}
+
+	// Private and writable, so nothing downstream has to know it isn't malloced.
+	char *map = (char *) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == (char *) MAP_FAILED) {
+		if (!source) fprintf(stderr, "Unable to map %s\n", filename);
+		return 0;
+	}
+
+	// Everything downstream indexes scratch with these and trusts the opcodes, so a
+	// flipped bit in here would otherwise be a crash.
+	const operation *ops = (const operation *) (map + header.func_offset);
+	for (int i = 0; i < header.size; i++) {
+		int n = arity(ops[i].code);
+		if (((unsigned) ops[i].code > MIN_IMM) || (ops[i].line < 0) || (ops[i].line >= header.slots)
+				|| ((n >= 1) && ((ops[i].a < 0) || (ops[i].a >= header.slots)))
+				|| ((n == 2) && ((ops[i].b < 0) || (ops[i].b >= header.slots)))) {
+			if (!source) fprintf(stderr, "%s: tape truncated or damaged\n", filename);
+			munmap(map, st.st_size);
+			return 0;
+		}
+	}
+
+	out->size = header.size;
+	out->slots = header.slots;
+	out->func = (operation *) (map + header.func_offset);
+	out->jit = (jit_code *)0;
+	out->packed = (packed_op *)0;
+	out->pool = (fp_type *)0;
+	out->mapping = map;
+	out->mapsize = st.st_size;
+	out->xops = 0;
+	out->yops = 0;
+	out->sorted = (func *)0;
+	return 1;
+}
@@ -0,0 +1,601 @@
+/*
+ * check.c
+ *
+ * Driver for make check. Renders a function with every evaluator on exactly the pixel
+ * grid basic_python.py uses (the JIT on the whole function, see jit_image), and
+ * compares each image a pixel at a time against a golden one from it, then times each
+ * and compares that against a baseline from an earlier run. Anything that's wrong, or slower than the baseline by more than the
+ * slack allows, fails the check. It also writes the generated stress functions the
+ * check renders besides prospero.vm, and has a reference of its own for when there's
+ * no numpy to run basic_python.py with.
+ *
+ * The reference does what numpy does, and needs to be built without -ffast-math to
+ * keep doing it: max and min of a NaN are NaN, and NaN is never inside.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_VARIANTS 8
+
+// Pixels the reference works out at a time
+#define REFERENCE_BLOCK 64
+
+// Stress functions, how many of the interesting instructions each gets
+#define STRESS_DEPTH 8000
+#define STRESS_LEAVES 1024
+#define STRESS_SIDES 2000
+
+enum variant {VARIANT_DOUBLE, VARIANT_FLOAT, VARIANT_MIXED, VARIANT_JIT};
+const char *variant_names[] = {"double", "float", "mixed", "jit"};
+
+// A line of the baseline file
+typedef struct {
+	char name[256];
+	char variant[16];
+	int size;
+	double rate;
+} baseline_entry;
+
+
+/* The x and y of numpy's linspace(-1, 1, size), and its negative. Exactly the same
+ * sums numpy does, so exactly the same numbers. Caller frees both. */
+static void numpy_axes(int size, fp_type **xspace, fp_type **yspace) {
+	double step = 2.0 / (size - 1);
+	*xspace = (fp_type *) malloc(sizeof(fp_type) * size);
+	*yspace = (fp_type *) malloc(sizeof(fp_type) * size);
+	if (!(*xspace && *yspace)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (int i = 0; i < size; i++) (*xspace)[i] = (i * step) + -1.0;
+	(*xspace)[size - 1] = 1.0;
+	for (int i = 0; i < size; i++) (*yspace)[i] = -(*xspace)[i];
+}
+
+
+/* basic_python.py's max and min, which hang on to NaN where fmax and fmin drop it. */
+static double numpy_max(double a, double b) {
+	if (isnan(a) || isnan(b)) return NAN;
+	return a > b ? a : b;
+}
+
+static double numpy_min(double a, double b) {
+	if (isnan(a) || isnan(b)) return NAN;
+	return a < b ? a : b;
+}
+
+
+/* Render filename at size the way basic_python.py does: straight down the function
+ * as parsed, no passes, no intervals, in double. Into data, 255 inside and 0 outside. */
+static void reference_image(const char *filename, int size, unsigned char *data) {
+	func sdf = parse_file(filename);
+	fp_type *xspace, *yspace;
+	numpy_axes(size, &xspace, &yspace);
+	double *memory = (double *) malloc(sizeof(double) * REFERENCE_BLOCK * sdf.slots);
+	if (!memory) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+
+	long pixels = (long) size * size;
+	for (long start = 0; start < pixels; start += REFERENCE_BLOCK) {
+		int n = (pixels - start < REFERENCE_BLOCK) ? (int) (pixels - start) : REFERENCE_BLOCK;
+		for (int i = 0; i < sdf.size; i++) {
+			const operation *op = sdf.func + i;
+			double *dst = memory + ((long) op->line * REFERENCE_BLOCK);
+			const double *a = memory + ((long) op->a * REFERENCE_BLOCK);
+			const double *b = memory + ((long) op->b * REFERENCE_BLOCK);
+			int j;
+			switch (op->code) {
+				case VAR_X: for (j = 0; j < n; j++) dst[j] = xspace[(start + j) % size]; break;
+				case VAR_Y: for (j = 0; j < n; j++) dst[j] = yspace[(start + j) / size]; break;
+				case CONST: for (j = 0; j < n; j++) dst[j] = op->value; break;
+				case ADD: for (j = 0; j < n; j++) dst[j] = a[j] + b[j]; break;
+				case SUB: for (j = 0; j < n; j++) dst[j] = a[j] - b[j]; break;
+				case MUL: for (j = 0; j < n; j++) dst[j] = a[j] * b[j]; break;
+				case MAX: for (j = 0; j < n; j++) dst[j] = numpy_max(a[j], b[j]); break;
+				case MIN: for (j = 0; j < n; j++) dst[j] = numpy_min(a[j], b[j]); break;
+				case NEG: for (j = 0; j < n; j++) dst[j] = -a[j]; break;
+				case SQUARE: for (j = 0; j < n; j++) dst[j] = a[j] * a[j]; break;
+				case SQRT: for (j = 0; j < n; j++) dst[j] = sqrt(a[j]); break;
+				default:
+					fprintf(stderr, "%s: instruction %d isn't one a file can have\n", filename, i);
+					exit(1);
+			}
+		}
+		const double *out = memory + ((long) sdf.func[sdf.size - 1].line * REFERENCE_BLOCK);
+		for (int j = 0; j < n; j++) data[start + j] = (out[j] < 0) ? 255 : 0;
+	}
+
+	free(memory);
+	free(xspace);
+	free(yspace);
+	free(sdf.func);
+}
+
+
+/* Read a P5 pgm, like basic_python.py writes. Returns the pixels, which the caller
+ * frees, or exits if it isn't one. */
+static unsigned char *read_pgm(const char *filename, int *width, int *height) {
+	int maxval;
+	FILE *fp = fopen(filename, "rb");
+	if (!fp) {
+		fprintf(stderr, "Unable to open %s\n", filename);
+		exit(1);
+	}
+	if ((fscanf(fp, "P5 %d %d %d", width, height, &maxval) != 3) || (fgetc(fp) == EOF)
+			|| (*width < 2) || (*height < 2) || (maxval != 255)) {
+		fprintf(stderr, "%s isn't a pgm from basic_python.py\n", filename);
+		exit(1);
+	}
+	long n = (long) *width * *height;
+	unsigned char *data = (unsigned char *) malloc(n);
+	if (!data) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	if (fread(data, 1, n, fp) != (size_t) n) {
+		fprintf(stderr, "%s is short\n", filename);
+		exit(1);
+	}
+	fclose(fp);
+	return data;
+}
+
+
+/* A number between 0 and 1 from a fixed sequence, so the stress functions come out
+ * the same every time. */
+static double next_random(uint64_t *state) {
+	*state = (*state * 6364136223846793005ULL) + 1442695040888963407ULL;
+	return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* Write a circle of radius r at cx, cy to fp, as lines from next on. Returns the
+ * name of its distance. */
+static int write_circle(FILE *fp, int *next, double cx, double cy, double r) {
+	int n = *next;
+	fprintf(fp, "_%x var-x\n_%x var-y\n", n, n + 1);
+	fprintf(fp, "_%x const %.17g\n_%x sub _%x _%x\n_%x square _%x\n", n + 2, cx, n + 3, n, n + 2, n + 4, n + 3);
+	fprintf(fp, "_%x const %.17g\n_%x sub _%x _%x\n_%x square _%x\n", n + 5, cy, n + 6, n + 1, n + 5, n + 7, n + 6);
+	fprintf(fp, "_%x add _%x _%x\n_%x sqrt _%x\n", n + 8, n + 4, n + 7, n + 9, n + 8);
+	fprintf(fp, "_%x const %.17g\n_%x sub _%x _%x\n", n + 10, r, n + 11, n + 9, n + 10);
+	*next = n + 12;
+	return n + 11;
+}
+
+
+/* Combine the n distances in names pairwise into one, a level at a time: two levels
+ * of union with min, then one of cutting with max, and again. Returns its name. */
+static int write_tree(FILE *fp, int *next, int *names, int n) {
+	for (int level = 0; n > 1; level++) {
+		int k = 0;
+		for (int i = 0; i + 1 < n; i += 2) {
+			if (level % 3 == 2) {
+				// Cut the second out of the first.
+				fprintf(fp, "_%x neg _%x\n_%x max _%x _%x\n", *next, names[i + 1], *next + 1, names[i], *next);
+				*next += 2;
+			} else {
+				fprintf(fp, "_%x min _%x _%x\n", (*next)++, names[i], names[i + 1]);
+			}
+			names[k++] = *next - 1;
+		}
+		if (n % 2) names[k++] = names[n - 1];
+		n = k;
+	}
+	return names[0];
+}
+
+
+/* Write one of the stress functions:
+ *   deep    one long chain, every step needing the last
+ *   wide    thousands of circles in a tree of min and max
+ *   sqrt    square roots of negative numbers, and what comes of them
+ *   consts  a polygon with thousands of sides, every one its own constants
+ *   shared  circles whose squares something else reads too, so fuse has to keep them
+ * Returns 1 if it knew the kind. */
+static int write_stress(const char *kind, const char *filename) {
+	uint64_t seed = 2025;
+	int next = 0, d;
+	FILE *fp;
+
+	if (strcmp(kind, "deep") && strcmp(kind, "wide") && strcmp(kind, "sqrt") && strcmp(kind, "consts") &&
+			strcmp(kind, "shared")) return 0;
+	fp = fopen(filename, "w");
+	if (!fp) {
+		fprintf(stderr, "Unable to open %s for writing\n", filename);
+		exit(1);
+	}
+	fprintf(fp, "# make check stress function: %s\n", kind);
+
+	if (!strcmp(kind, "deep")) {
+		// A ring, pushed around a little at every step of the chain.
+		d = write_circle(fp, &next, 0.0, 0.0, 0.6);
+		for (int i = 0; i < STRESS_DEPTH; i++) {
+			double c = (next_random(&seed) - 0.5) * 1e-3;
+			fprintf(fp, "_%x const %.17g\n", next, c);
+			if (i % 4 == 0) fprintf(fp, "_%x add _%x _%x\n", next + 1, d, next);
+			if (i % 4 == 1) fprintf(fp, "_%x sub _%x _%x\n", next + 1, d, next);
+			if (i % 4 == 2) fprintf(fp, "_%x mul _%x _%x\n_%x add _%x _%x\n", next + 1, d, next, next + 2, next + 1, d);
+			if (i % 4 == 3) fprintf(fp, "_%x neg _%x\n_%x neg _%x\n", next + 1, d, next + 2, next + 1);
+			d = next + ((i % 4 < 2) ? 1 : 2);
+			next += 3;
+		}
+		fprintf(fp, "_%x square _%x\n_%x const 0.04\n_%x sub _%x _%x\n", next, d, next + 1, next + 2, next, next + 1);
+	} else if (!strcmp(kind, "wide")) {
+		int *names = (int *) malloc(sizeof(int) * STRESS_LEAVES);
+		if (!names) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		for (int i = 0; i < STRESS_LEAVES; i++) {
+			double cx = next_random(&seed) * 2 - 1, cy = next_random(&seed) * 2 - 1;
+			names[i] = write_circle(fp, &next, cx, cy, 0.01 + next_random(&seed) * 0.05);
+		}
+		write_tree(fp, &next, names, STRESS_LEAVES);
+		free(names);
+	} else if (!strcmp(kind, "sqrt")) {
+		// sqrt(x * y) is NaN in two quadrants, and sqrt(-d) of a circle is NaN outside
+		// it, and square(sqrt(x * y)) had better not turn into x * y. The NaNs only go
+		// through the arithmetic: max and min of one aren't the same here as in numpy.
+		fprintf(fp, "_0 var-x\n_1 var-y\n_2 mul _0 _1\n_3 sqrt _2\n_4 const 0.3\n_5 sub _3 _4\n");
+		next = 6;
+		int a = write_circle(fp, &next, 0.4, -0.4, 0.3);
+		int b = write_circle(fp, &next, -0.5, 0.5, 0.3);
+		int c = write_circle(fp, &next, 0.0, 0.0, 0.6);
+		fprintf(fp, "_%x neg _%x\n_%x sqrt _%x\n_%x const 0.5\n_%x sub _%x _%x\n", next, c, next + 1, next,
+				next + 2, next + 3, next + 1, next + 2);
+		fprintf(fp, "_%x mul _5 _%x\n_%x mul _%x _%x\n_%x add _%x _%x\n", next + 4, a, next + 5, next + 3, b,
+				next + 6, next + 4, next + 5);
+		fprintf(fp, "_%x square _3\n_%x const 0.04\n_%x sub _%x _%x\n_%x mul _%x _%x\n", next + 7, next + 8,
+				next + 9, next + 7, next + 8, next + 10, next + 6, next + 9);
+	} else if (!strcmp(kind, "shared")) {
+		// sqrt(x^2 + y^2) + x^2 reads x^2 after the sqrt has had it, a slab reads its
+		// square twice from one add, and a circle gets cut by its own x^2.
+		fprintf(fp, "_0 var-x\n_1 var-y\n_2 square _0\n_3 square _1\n_4 add _2 _3\n_5 sqrt _4\n");
+		fprintf(fp, "_6 add _5 _2\n_7 const 0.5\n_8 sub _6 _7\n");
+		fprintf(fp, "_9 const 0.3\n_a sub _0 _9\n_b square _a\n_c add _b _b\n_d sqrt _c\n");
+		fprintf(fp, "_e const 0.1\n_f sub _d _e\n_10 min _8 _f\n");
+		next = 0x11;
+		int c = write_circle(fp, &next, -0.4, 0.4, 0.3);
+		fprintf(fp, "_%x const 0.02\n_%x sub _%x _%x\n_%x max _%x _%x\n_%x min _10 _%x\n", next, next + 1,
+				c - 7, next, next + 2, c, next + 1, next + 3, next + 2);
+	} else {
+		fprintf(fp, "_0 var-x\n_1 var-y\n");
+		next = 2;
+		d = -1;
+		for (int i = 0; i < STRESS_SIDES; i++) {
+			double angle = (6.283185307179586 * i) / STRESS_SIDES;
+			double r = 0.7 + 0.05 * sin(37.0 * angle) + next_random(&seed) * 1e-3;
+			fprintf(fp, "_%x const %.17g\n_%x mul _0 _%x\n", next, cos(angle), next + 1, next);
+			fprintf(fp, "_%x const %.17g\n_%x mul _1 _%x\n", next + 2, sin(angle), next + 3, next + 2);
+			fprintf(fp, "_%x add _%x _%x\n_%x const %.17g\n", next + 4, next + 1, next + 3, next + 5, r);
+			fprintf(fp, "_%x sub _%x _%x\n", next + 6, next + 4, next + 5);
+			if (d >= 0) {
+				fprintf(fp, "_%x max _%x _%x\n", next + 7, d, next + 6);
+				d = next + 7;
+			} else {
+				d = next + 6;
+			}
+			next += 8;
+		}
+	}
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Unable to write %s\n", filename);
+		exit(1);
+	}
+	return 1;
+}
+
+
+/* Read the baseline file into entries, returns how many there are. No file is no
+ * entries. */
+static int read_baseline(const char *filename, baseline_entry **entries) {
+	baseline_entry entry;
+	int n = 0, capacity = 16;
+	*entries = (baseline_entry *) malloc(sizeof(baseline_entry) * capacity);
+	if (!*entries) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	FILE *fp = fopen(filename, "r");
+	if (!fp) return 0;
+	while (fscanf(fp, "%255s %15s %d %lf", entry.name, entry.variant, &entry.size, &entry.rate) == 4) {
+		if (n == capacity) {
+			capacity *= 2;
+			*entries = (baseline_entry *) realloc(*entries, sizeof(baseline_entry) * capacity);
+			if (!*entries) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(1);
+			}
+		}
+		(*entries)[n++] = entry;
+	}
+	fclose(fp);
+	return n;
+}
+
+
+/* The entry for a run in the baseline, or null if it hasn't got one. */
+static baseline_entry *find_baseline(baseline_entry *entries, int n, const char *name, const char *variant, int size) {
+	for (int i = 0; i < n; i++) {
+		if (!strcmp(entries[i].name, name) && !strcmp(entries[i].variant, variant) && (entries[i].size == size)) {
+			return entries + i;
+		}
+	}
+	return (baseline_entry *)0;
+}
+
+
+/* Render every pixel of the size by size image at xspace and yspace with the JIT's code
+ * for the whole function, into image, one byte a pixel like the golden ones. The
+ * renderer never gets that far with the JIT, tiles run their own short functions on
+ * the interpreter, so this is the only way the check sees what the JIT does. */
+static void jit_image(func *sdf, const fp_type *xspace, const fp_type *yspace, int size, unsigned char *image) {
+	fp_type xs[JIT_MAX_WIDTH], ys[JIT_MAX_WIDTH], out[JIT_MAX_WIDTH];
+	int width = sdf->jit->width;
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x += width) {
+			for (int j = 0; j < width; j++) {
+				xs[j] = xspace[(x + j < size) ? x + j : size - 1];
+				ys[j] = yspace[y];
+			}
+			sdf->jit->fn(xs, ys, out);
+			for (int j = 0; (j < width) && (x + j < size); j++) {
+				image[((long) y * size) + x + j] = (out[j] < 0) ? 255 : 0;
+			}
+		}
+	}
+}
+
+
+static double seconds(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) + ((end->tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+/* Usage:
+ *   checker -g kind file.vm             write a stress function, see write_stress
+ *   checker -R file.vm size golden.pgm  write a golden image without numpy
+ *   checker [options] file.vm golden.pgm [file.vm golden.pgm ...]
+ * Options for the last:
+ *   -v  evaluators to check: double, float, mixed, jit (default all of them)
+ *   -t  threads to render with (default NUM_THREADS)
+ *   -r  timed runs per evaluator, the median counts (default 3)
+ *   -m  pixels float may get wrong, as a fraction of them all (default 1e-4)
+ *   -b  baseline file, rates in pixels a second from an earlier run (default none)
+ *   -x  percent slower than the baseline that fails (default 15)
+ *   -u  write the rates from this run to the baseline when everything passes, needs -b
+ * Everything but float has to match the golden image exactly: mixed does its close
+ * calls over in double, so it has no excuse. Exits 1 if anything failed. */
+int main(int argc, char **argv) {
+	int variants[MAX_VARIANTS], nvariants = 4;
+	int num_threads = NUM_THREADS, repeats = 3, update = 0, failed = 0, opt;
+	double float_slack = 1e-4, slack = 15.0;
+	const char *stress = (const char *)0, *basefile = (const char *)0;
+	int reference = 0;
+
+	for (int v = 0; v < nvariants; v++) variants[v] = v;
+	while ((opt = getopt(argc, argv, "g:Rv:t:r:m:b:x:u")) != -1) {
+		switch (opt) {
+			case 'g': stress = optarg; break;
+			case 'R': reference = 1; break;
+			case 'v':
+				nvariants = 0;
+				for (char *tok = strtok(optarg, ","); tok && (nvariants < MAX_VARIANTS); tok = strtok((char *)0, ",")) {
+					int v;
+					for (v = 0; v <= VARIANT_JIT; v++) if (!strcmp(tok, variant_names[v])) break;
+					if (v > VARIANT_JIT) {
+						fprintf(stderr, "Unknown variant: %s\n", tok);
+						exit(1);
+					}
+					variants[nvariants++] = v;
+				}
+				break;
+			case 't': num_threads = atoi(optarg); break;
+			case 'r': repeats = atoi(optarg); break;
+			case 'm': float_slack = atof(optarg); break;
+			case 'b': basefile = optarg; break;
+			case 'x': slack = atof(optarg); break;
+			case 'u': update = 1; break;
+			default:
+				fprintf(stderr, "Usage: %s -g kind file.vm | -R file.vm size golden.pgm | "
+						"[-v variants] [-t threads] [-r repeats] [-m float_slack] [-b baseline] [-x percent] [-u] "
+						"file.vm golden.pgm ...\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	if (update && !basefile) {
+		fprintf(stderr, "-u needs a baseline file to write, with -b\n");
+		exit(1);
+	}
+
+	if (stress) {
+		if ((optind >= argc) || !write_stress(stress, argv[optind])) {
+			fprintf(stderr, "Usage: %s -g deep|wide|sqrt|consts|shared file.vm\n", argv[0]);
+			exit(1);
+		}
+		return 0;
+	}
+
+	if (reference) {
+		int size = (optind + 2 < argc) ? atoi(argv[optind + 1]) : 0;
+		if (size < 2) {
+			fprintf(stderr, "Usage: %s -R file.vm size golden.pgm\n", argv[0]);
+			exit(1);
+		}
+		unsigned char *data = (unsigned char *) malloc((long) size * size);
+		if (!data) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		reference_image(argv[optind], size, data);
+		if (!write_ppm(argv[optind + 2], (char *) data, size, size)) exit(1);
+		free(data);
+		return 0;
+	}
+
+	if ((optind >= argc) || ((argc - optind) % 2)) {
+		fprintf(stderr, "Every function needs a golden image to go with it.\n");
+		exit(1);
+	}
+	if (repeats < 1) repeats = 1;
+
+	baseline_entry *baseline;
+	int nbaseline = basefile ? read_baseline(basefile, &baseline) : 0;
+	int capacity = nbaseline + (((argc - optind) / 2) * nvariants);
+	if (!basefile) baseline = (baseline_entry *)0;
+	else baseline = (baseline_entry *) realloc(baseline, sizeof(baseline_entry) * (capacity ? capacity : 1));
+	double *times = (double *) malloc(sizeof(double) * repeats);
+	if ((basefile && !baseline) || !times) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+
+	renderer *r = create_pinned_renderer(num_threads);
+	printf("%-24s %-7s %6s %10s %10s %14s  %s\n", "function", "variant", "size", "wrong", "median s", "pixels/s", "baseline");
+	for (int f = optind; f < argc; f += 2) {
+		const char *filename = argv[f];
+		int width, height;
+		unsigned char *golden = read_pgm(argv[f + 1], &width, &height);
+		fp_type *xspace, *yspace;
+		numpy_axes(width, &xspace, &yspace);
+		if (width != height) {
+			fprintf(stderr, "%s isn't square\n", argv[f + 1]);
+			exit(1);
+		}
+		int size = width;
+		int across = (size + TILE_SIZE - 1) / TILE_SIZE;
+		int ntiles = across * across;
+		int *tiles = (int *) malloc(sizeof(int) * ntiles);
+		unsigned char *bits = (unsigned char *) malloc((long) MASK_STRIDE(size) * size);
+		unsigned char *image = (unsigned char *) malloc((long) size * size);
+		char *row = (char *) malloc(size);
+		if (!(tiles && bits && image && row)) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		for (int i = 0; i < ntiles; i++) tiles[i] = i;
+
+		func *sdf = load_func(filename, 0);
+		const char *name = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+		for (int v = 0; v < nvariants; v++) {
+			int precision = PRECISION_DOUBLE;
+			if (variants[v] == VARIANT_FLOAT) precision = PRECISION_FLOAT;
+			if (variants[v] == VARIANT_MIXED) precision = PRECISION_MIXED;
+			if (variants[v] == VARIANT_JIT) {
+				// jit_compile has something to say, give it a line of its own.
+				sdf->jit = jit_compile(sdf);
+				printf("\n");
+				if (!sdf->jit) {
+					printf("%-24s %-7s  JIT unavailable, skipped\n", name, variant_names[variants[v]]);
+					continue;
+				}
+			}
+
+			// The first one is the one that gets checked, and warms up for the rest.
+			int jit = (variants[v] == VARIANT_JIT);
+			if (jit) jit_image(sdf, xspace, yspace, size, image);
+			else render_tile_set(r, sdf, xspace, yspace, size, size, precision, bits, tiles, ntiles);
+			long wrong = 0;
+			for (int y = 0; y < size; y++) {
+				if (jit) memcpy(row, image + ((long) y * size), size);
+				else unpack_mask_row(bits + ((long) y * MASK_STRIDE(size)), size, row);
+				for (int x = 0; x < size; x++) {
+					if ((unsigned char) row[x] != golden[((long) y * size) + x]) {
+						if (wrong < 5) fprintf(stderr, "%s %s: pixel %d, %d should be %s\n", name, variant_names[variants[v]],
+								x, y, golden[((long) y * size) + x] ? "inside" : "outside");
+						wrong++;
+					}
+				}
+			}
+			for (int i = 0; i < repeats; i++) {
+				struct timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (jit) jit_image(sdf, xspace, yspace, size, image);
+				else render_tile_set(r, sdf, xspace, yspace, size, size, precision, bits, tiles, ntiles);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				times[i] = seconds(&start, &end);
+			}
+			if (sdf->jit) {
+				jit_free(sdf->jit);
+				sdf->jit = (jit_code *)0;
+			}
+			qsort(times, repeats, sizeof(double), compare_double);
+			double time = times[repeats / 2];
+			double rate = ((double) size * size) / time;
+
+			long allowed = (variants[v] == VARIANT_FLOAT) ? (long) (float_slack * size * size) : 0;
+			baseline_entry *base = find_baseline(baseline, nbaseline, name, variant_names[variants[v]], size);
+			printf("%-24s %-7s %6d %10ld %10.4f %14.0f  ", name, variant_names[variants[v]], size, wrong, time, rate);
+			if (base) printf("%+.1f%%", 100.0 * ((rate / base->rate) - 1.0));
+			else printf("-");
+			if (wrong > allowed) {
+				printf("  FAILED, %ld pixels wrong\n", wrong);
+				failed = 1;
+			} else if (base && (rate < base->rate * (1.0 - (slack / 100.0)))) {
+				printf("  FAILED, more than %.0f%% slower\n", slack);
+				failed = 1;
+			} else {
+				printf("\n");
+			}
+			fflush(stdout);
+
+			if (update) {
+				if (!base) {
+					base = baseline + nbaseline++;
+					snprintf(base->name, sizeof(base->name), "%s", name);
+					snprintf(base->variant, sizeof(base->variant), "%s", variant_names[variants[v]]);
+					base->size = size;
+				}
+				base->rate = rate;
+			}
+		}
+
+		free_func(sdf);
+		free(golden);
+		free(xspace);
+		free(yspace);
+		free(tiles);
+		free(bits);
+		free(image);
+		free(row);
+	}
+	free_renderer(r);
+
+	if (update && basefile && !failed) {
+		FILE *fp = fopen(basefile, "w");
+		if (!fp) {
+			fprintf(stderr, "Unable to open %s for writing\n", basefile);
+			exit(1);
+		}
+		for (int i = 0; i < nbaseline; i++) {
+			fprintf(fp, "%s %s %d %.0f\n", baseline[i].name, baseline[i].variant, baseline[i].size, baseline[i].rate);
+		}
+		fclose(fp);
+		printf("Baseline written to %s\n", basefile);
+	}
+	printf(failed ? "Check FAILED\n" : "Check passed\n");
+
+	free(times);
+	free(baseline);
+	return failed;
+}
@@ -0,0 +1,286 @@
+/*
+ * distrib.c
+ *
+ * Rendering with more than one process. A coordinator hands tiles out to worker
+ * processes over sockets and puts the image back together from what they send back.
+ * Each worker gets the tape once when it starts, and after that nothing but tile
+ * numbers, so nothing here cares whether the other end of the socket is a fork of
+ * this process or something further away.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define DIST_MAGIC 0x50524f53
+
+// Tiles a worker can have handed to it at once, so it never waits on the coordinator
+#define DIST_INFLIGHT 2
+
+// The first thing a worker hears, followed by the size operations of the tape
+typedef struct {
+	uint32_t magic;
+	int32_t width;
+	int32_t height;
+	int32_t precision;
+	int32_t size;
+	int32_t slots;
+	viewport view;
+} dist_setup;
+
+// A worker as the coordinator sees it, with the tiles it owes in the order it got them
+typedef struct {
+	int fd;
+	pid_t pid;
+	int alive;
+	int inflight[DIST_INFLIGHT];
+	int head;
+	int count;
+} dist_worker;
+
+
+/* Read exactly size bytes from fd. Returns 1, or 0 if the other end went away first. */
+static int read_full(int fd, void *buf, long size) {
+	char *p = (char *) buf;
+	while (size > 0) {
+		ssize_t got = read(fd, p, size);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return 0;
+		p += got;
+		size -= got;
+	}
+	return 1;
+}
+
+
+/* Write exactly size bytes to fd. Returns 1, or 0 if it couldn't. */
+static int write_full(int fd, const void *buf, long size) {
+	const char *p = (const char *) buf;
+	while (size > 0) {
+		ssize_t done = write(fd, p, size);
+		if (done < 0 && errno == EINTR) continue;
+		if (done <= 0) return 0;
+		p += done;
+		size -= done;
+	}
+	return 1;
+}
+
+
+/* Where tile t of a width by height image is, and how big. */
+static void tile_rect(int t, int width, int height, int *x, int *y, int *w, int *h) {
+	int across = (width + TILE_SIZE - 1) / TILE_SIZE;
+	*x = (t % across) * TILE_SIZE;
+	*y = (t / across) * TILE_SIZE;
+	*w = (width - *x < TILE_SIZE) ? width - *x : TILE_SIZE;
+	*h = (height - *y < TILE_SIZE) ? height - *y : TILE_SIZE;
+}
+
+
+/* Be a worker on the other end of fd: read the tape, then render every tile asked
+ * for with render_chunk and send it back, a byte a pixel, until the coordinator
+ * hangs up. Returns 0 when it does, 1 if something went wrong first. */
+int serve_tiles(int fd) {
+	dist_setup setup;
+	char tile[TILE_SIZE * TILE_SIZE];
+	fp_type *xspace, *yspace;
+	scratchpad pad;
+	int32_t t;
+	int x, y, w, h;
+
+	if (!read_full(fd, &setup, sizeof(setup)) || (setup.magic != DIST_MAGIC) || (setup.size < 1)) return 1;
+	func *sdf = (func *) calloc(1, sizeof(func));
+	operation *ops = (operation *) malloc(sizeof(operation) * setup.size);
+	if (!(sdf && ops)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	if (!read_full(fd, ops, sizeof(operation) * setup.size)) {
+		free(ops);
+		free(sdf);
+		return 1;
+	}
+	sdf->func = ops;
+	sdf->size = setup.size;
+	sdf->slots = setup.slots;
+	if (PACKED) pack_func(sdf);
+	separate_func(sdf);
+
+	view_axes(&setup.view, setup.width, setup.height, &xspace, &yspace);
+	scratchpad_init(&pad);
+	scratchpad_reserve(&pad, sdf, setup.precision);
+
+	int status = 0;
+	while (read_full(fd, &t, sizeof(t))) {
+		tile_rect(t, setup.width, setup.height, &x, &y, &w, &h);
+		render_chunk(sdf, &pad, x, y, w, h, tile, w, xspace, yspace);
+		if (!(write_full(fd, &t, sizeof(t)) && write_full(fd, tile, (long) w * h))) {
+			status = 1;
+			break;
+		}
+	}
+
+	scratchpad_free(&pad);
+	free(xspace);
+	free(yspace);
+	free_func(sdf);
+	return status;
+}
+
+
+/* Give up on a worker, and put the tiles it owed back on the pile. */
+static void lose_worker(dist_worker *worker, int id, int *todo, int *ntodo) {
+	fprintf(stderr, "Worker %d went away, %d tiles go back to the others\n", id, worker->count);
+	while (worker->count) {
+		todo[(*ntodo)++] = worker->inflight[worker->head];
+		worker->head = (worker->head + 1) % DIST_INFLIGHT;
+		worker->count--;
+	}
+	close(worker->fd);
+	kill(worker->pid, SIGKILL);
+	worker->alive = 0;
+}
+
+
+/* render_view, with num_procs processes instead of threads. Each one is forked off
+ * with a socket back to this one, and serve_tiles does the rendering. Tiles are
+ * handed out DIST_INFLIGHT at a time to whoever has room for more, and as each comes
+ * back it goes into data, which is a mask like render_mask's with bits, or a byte a
+ * pixel without. If a worker dies or talks nonsense, the tiles it had go to the
+ * rest, so the image gets finished as long as one of them is left.
+ * Returns 1 if every tile got done. */
+int render_distributed(func *sdf, const viewport *view, int width, int height, int precision, int num_procs, char *data, int bits) {
+	char tile[TILE_SIZE * TILE_SIZE];
+	dist_setup setup;
+	int32_t t;
+	int i, x, y, w, h, done = 0, alive = 0;
+	int ntiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+
+	dist_worker *workers = (dist_worker *) calloc(num_procs, sizeof(dist_worker));
+	struct pollfd *polls = (struct pollfd *) malloc(sizeof(struct pollfd) * num_procs);
+	int *owner = (int *) malloc(sizeof(int) * num_procs);
+	int *todo = (int *) malloc(sizeof(int) * ntiles);
+	if (!(workers && polls && owner && todo)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	// A stack, so tile 0 goes out first.
+	for (i = 0; i < ntiles; i++) todo[i] = ntiles - 1 - i;
+	int ntodo = ntiles;
+
+	// A worker that dies mid write shouldn't take us with it.
+	signal(SIGPIPE, SIG_IGN);
+
+	setup.magic = DIST_MAGIC;
+	setup.width = width;
+	setup.height = height;
+	setup.precision = precision;
+	setup.size = sdf->size;
+	setup.slots = sdf->slots;
+	setup.view = *view;
+
+	for (i = 0; i < num_procs; i++) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+			fprintf(stderr, "Problem creating socket\n");
+			exit(1);
+		}
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "Problem creating process\n");
+			exit(1);
+		}
+		if (pid == 0) {
+			// Hang on to nothing but our own socket, or the others never see EOF.
+			for (int j = 0; j < i; j++) if (workers[j].alive) close(workers[j].fd);
+			close(sv[0]);
+			_exit(serve_tiles(sv[1]));
+		}
+		close(sv[1]);
+		workers[i].fd = sv[0];
+		workers[i].pid = pid;
+		workers[i].alive = 1;
+		if (!(write_full(sv[0], &setup, sizeof(setup)) && write_full(sv[0], sdf->func, sizeof(operation) * sdf->size))) {
+			lose_worker(workers + i, i, todo, &ntodo);
+		}
+	}
+
+	while (done < ntiles) {
+		int n = 0;
+		for (i = 0; i < num_procs; i++) {
+			dist_worker *worker = workers + i;
+			while (worker->alive && (worker->count < DIST_INFLIGHT) && ntodo) {
+				t = todo[--ntodo];
+				worker->inflight[(worker->head + worker->count) % DIST_INFLIGHT] = t;
+				worker->count++;
+				if (!write_full(worker->fd, &t, sizeof(t))) lose_worker(worker, i, todo, &ntodo);
+			}
+			if (worker->alive) {
+				polls[n].fd = worker->fd;
+				polls[n].events = POLLIN;
+				owner[n++] = i;
+			}
+		}
+		if (!n) break;
+
+		if (poll(polls, n, -1) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Problem waiting on workers\n");
+			exit(1);
+		}
+		for (int k = 0; k < n; k++) {
+			if (!polls[k].revents) continue;
+			dist_worker *worker = workers + owner[k];
+			// Tiles come back in the order they went out.
+			if (!read_full(worker->fd, &t, sizeof(t)) || !worker->count || (t != worker->inflight[worker->head])) {
+				lose_worker(worker, owner[k], todo, &ntodo);
+				continue;
+			}
+			tile_rect(t, width, height, &x, &y, &w, &h);
+			if (!read_full(worker->fd, tile, (long) w * h)) {
+				lose_worker(worker, owner[k], todo, &ntodo);
+				continue;
+			}
+			for (int row = 0; row < h; row++) {
+				if (bits) {
+					pack_mask_row(tile + (row * w), w, (unsigned char *) data + ((long) (y + row) * MASK_STRIDE(width)) + (x / 8));
+				} else {
+					memcpy(data + ((long) (y + row) * width) + x, tile + (row * w), w);
+				}
+			}
+			worker->head = (worker->head + 1) % DIST_INFLIGHT;
+			worker->count--;
+			done++;
+		}
+	}
+
+	// Hanging up is how the workers know to stop.
+	for (i = 0; i < num_procs; i++) {
+		if (workers[i].alive) {
+			close(workers[i].fd);
+			alive++;
+		}
+		waitpid(workers[i].pid, NULL, 0);
+	}
+	if (done < ntiles) fprintf(stderr, "Every worker went away with %d tiles still to do\n", ntiles - done);
+	else if (alive < num_procs) fprintf(stderr, "Finished with %d of %d workers\n", alive, num_procs);
+
+	free(workers);
+	free(polls);
+	free(owner);
+	free(todo);
+	return done == ntiles;
+}
@@ -0,0 +1,553 @@
+/*
+ * jit.c
+ *
+ * x86-64 machine code for the Prospero Challenge renderer.
+ * Turns a parsed function into a native routine that works out a few pixels at once,
+ * instead of asking the switch statement in render_block what to do 7866 times.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Registers ymm/xmm 14 and 15 are kept free for loading operands that live in memory.
+#define JIT_REGISTERS 14
+#define SCRATCH_A 14
+#define SCRATCH_B 15
+
+// Every constant in the pool is four lanes wide, so it can be used as an operand directly.
+#define POOL_ENTRY 32
+
+// x86 register numbers of the pointer arguments, System V calling convention.
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define RDX 2
+
+enum location {IN_REGISTER, ON_STACK, IN_POOL};
+
+typedef struct {
+	unsigned char *code;
+	int size;
+	int capacity;
+	int avx;
+	int *pool_fixups;	// offsets of rip relative displacements that point into the pool
+	int *pool_targets;	// and which pool entry each one wants
+	int nfixups;
+} assembler;
+
+
+static void emit(assembler *as, unsigned char byte) {
+	if (as->size == as->capacity) {
+		as->capacity *= 2;
+		as->code = (unsigned char *) realloc(as->code, as->capacity);
+		if (!as->code) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+	}
+	as->code[as->size++] = byte;
+}
+
+
+static void emit32(assembler *as, int32_t value) {
+	emit(as, value & 0xff);
+	emit(as, (value >> 8) & 0xff);
+	emit(as, (value >> 16) & 0xff);
+	emit(as, (value >> 24) & 0xff);
+}
+
+
+/* ModRM (and SIB, and displacement) for a register and a memory operand at base + disp.
+ * A base of -1 means the constant pool entry disp, relative to the instruction pointer. */
+static void emit_modrm_mem(assembler *as, int reg, int base, int disp) {
+	if (base < 0) {
+		emit(as, 0x05 | ((reg & 7) << 3));
+		if (as->nfixups % 1024 == 0) {
+			as->pool_fixups = (int *) realloc(as->pool_fixups, sizeof(int) * (as->nfixups + 1024));
+			as->pool_targets = (int *) realloc(as->pool_targets, sizeof(int) * (as->nfixups + 1024));
+			if (!(as->pool_fixups && as->pool_targets)) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(1);
+			}
+		}
+		as->pool_fixups[as->nfixups] = as->size;
+		as->pool_targets[as->nfixups] = disp;
+		as->nfixups++;
+		emit32(as, 0); // Patched once we know where the pool ends up.
+		return;
+	}
+	emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP) emit(as, 0x24);
+	emit32(as, disp);
+}
+
+
+/* Three byte VEX prefix, 256 bit vectors, 66 prefix. map is 1 for 0F. */
+static void emit_vex(assembler *as, int reg, int vvvv, int rm) {
+	emit(as, 0xc4);
+	emit(as, ((~reg & 8) << 4) | 0x40 | ((~rm & 8) << 2) | 0x01);
+	emit(as, ((~vvvv & 15) << 3) | 0x04 | 0x01);
+}
+
+
+/* Legacy SSE2 encoding, 66 prefix and a REX byte if any register is above 7. */
+static void emit_sse(assembler *as, int reg, int rm, unsigned char opcode) {
+	emit(as, 0x66);
+	if ((reg & 8) || (rm & 8)) emit(as, 0x40 | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+	emit(as, 0x0f);
+	emit(as, opcode);
+}
+
+
+/* dst = src1 op src2, all registers. For SSE, src1 must already be dst. */
+static void emit_op_rr(assembler *as, unsigned char opcode, int dst, int src1, int src2) {
+	if (as->avx) {
+		emit_vex(as, dst, src1, src2);
+		emit(as, opcode);
+	} else {
+		emit_sse(as, dst, src2, opcode);
+	}
+	emit(as, 0xc0 | ((dst & 7) << 3) | (src2 & 7));
+}
+
+
+/* dst = src1 op memory. For SSE, src1 must already be dst. */
+static void emit_op_rm(assembler *as, unsigned char opcode, int dst, int src1, int base, int disp) {
+	if (as->avx) {
+		emit_vex(as, dst, src1, (base < 0) ? 0 : base);
+		emit(as, opcode);
+	} else {
+		emit_sse(as, dst, (base < 0) ? 0 : base, opcode);
+	}
+	emit_modrm_mem(as, dst, base, disp);
+}
+
+
+static void emit_load(assembler *as, int reg, int base, int disp) {
+	emit_op_rm(as, 0x10, reg, 0, base, disp);   // movupd reg, [mem]
+}
+
+
+static void emit_store(assembler *as, int reg, int base, int disp) {
+	emit_op_rm(as, 0x11, reg, 0, base, disp);   // movupd [mem], reg
+}
+
+
+static void emit_move(assembler *as, int dst, int src) {
+	if (dst != src) emit_op_rr(as, 0x28, dst, 0, src);  // movapd dst, src
+}
+
+
+/* Emit dst = a op b for one of the two operand instructions. SSE only has
+ * dst = dst op b, so it needs a detour through scratch when dst is b. */
+static void emit_binary(assembler *as, unsigned char opcode, int dst, int a, int b) {
+	if (as->avx) {
+		emit_op_rr(as, opcode, dst, a, b);
+		return;
+	}
+	if ((dst == b) && (dst != a)) {
+		emit_move(as, SCRATCH_A, a);
+		emit_op_rr(as, opcode, SCRATCH_A, SCRATCH_A, b);
+		emit_move(as, dst, SCRATCH_A);
+		return;
+	}
+	emit_move(as, dst, a);
+	emit_op_rr(as, opcode, dst, dst, b);
+}
+
+
+/* The pool entry holding value, adding one if there isn't one yet. index is a hash 
+ * table of mask + 1 entry numbers, -1 for empty, so every distinct number only goes 
+ * in once however many instructions want it. */
+static int pool_entry(fp_type *pool, int *entries, int *index, int mask, fp_type value) {
+	uint64_t bits = 0, other = 0;
+	memcpy(&bits, &value, sizeof(value));
+	int h = (int) ((bits * 0x9e3779b97f4a7c15ULL) >> 40) & mask;
+	while (index[h] >= 0) {
+		memcpy(&other, pool + (index[h] * 4), sizeof(value));
+		if (other == bits) return index[h];
+		h = (h + 1) & mask;
+	}
+	for (int r = 0; r < 4; r++) pool[*entries * 4 + r] = value;
+	index[h] = *entries;
+	return (*entries)++;
+}
+
+
+/* Compile the function into native code.
+ *
+ * Every value gets a vector register for as long as something still has to read it.
+ * When the registers run out, the value that will be needed furthest in the future
+ * goes to the stack, and stays there, getting loaded into scratch whenever it's used.
+ * Constants never take a register, they live in a pool after the code and get used
+ * straight from memory, immediate operands included. The result is a function taking pointers to x and y values
+ * for jit->width pixels, and a place to put the results.
+ *
+ * Uses AVX2 (four pixels per call) if the processor has it, otherwise SSE2 (two).
+ * Returns null if there is no way to run the code here. Free with jit_free. */
+jit_code *jit_compile(func *sdf) {
+#ifndef DOUBLE
+	fprintf(stderr, "The JIT only speaks double precision.\n");
+	return (jit_code *)0;
+#endif
+	int size = sdf->size;
+	int *producer = (int *) malloc(sizeof(int) * sdf->slots);
+	int *srca = (int *) malloc(sizeof(int) * size);
+	int *srcb = (int *) malloc(sizeof(int) * size);
+	int *last_use = (int *) malloc(sizeof(int) * size);
+	int *where = (int *) malloc(sizeof(int) * size);     // enum location
+	int *place = (int *) malloc(sizeof(int) * size);     // register number, stack slot or pool entry
+	int *free_stack = (int *) malloc(sizeof(int) * size);
+	fp_type *pool = (fp_type *) calloc(size + 1, POOL_ENTRY);
+	int mask = 1;
+	while (mask < 2 * (size + 1)) mask <<= 1;
+	int *pool_index = (int *) malloc(sizeof(int) * mask);
+	mask -= 1;
+	if (!(producer && srca && srcb && last_use && where && place && free_stack && pool && pool_index)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	int holder[16];	// which value is in each register, -1 for nobody
+	// addpd, subpd, -, mulpd, maxpd, minpd for the _IMM opcodes, in order.
+	static const unsigned char imm_opcode[] = {0x58, 0x5c, 0, 0x59, 0x5f, 0x5d};
+	int nfree_stack = 0, stack_slots = 0, pool_entries = 0;
+	int i, r, a, b, dst, ra, rb, frame_fixup;
+	operation *oper;
+
+	assembler as;
+	as.capacity = 4096;
+	as.size = 0;
+	as.code = (unsigned char *) malloc(as.capacity);
+	as.pool_fixups = (int *)0;
+	as.pool_targets = (int *)0;
+	as.nfixups = 0;
+	as.avx = __builtin_cpu_supports("avx2");
+	if (!as.code) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+
+	// Pool entry 0 is the sign bit, for NEG.
+	for (i = 0; i <= mask; i++) pool_index[i] = -1;
+	pool_entry(pool, &pool_entries, pool_index, mask, -0.0);
+
+	// Same liveness analysis as allocate_registers, by position in the function.
+	for (i = 0; i < size; i++) {
+		oper = sdf->func + i;
+		last_use[i] = -1;
+		switch (oper->code) {
+			case VAR_X:
+			case VAR_Y:
+			case CONST:
+				break;
+			case NEG:
+			case SQUARE:
+			case SQRT:
+			case ADD_IMM:
+			case SUB_IMM:
+			case IMM_SUB:
+			case MUL_IMM:
+			case MAX_IMM:
+			case MIN_IMM:
+				srca[i] = producer[oper->a];
+				last_use[srca[i]] = i;
+				break;
+			case ADD:
+			case SUB:
+			case MUL:
+			case MAX:
+			case MIN:
+			case HYPOT:
+			case MAX_NEG:
+			case MIN_NEG:
+				srca[i] = producer[oper->a];
+				srcb[i] = producer[oper->b];
+				last_use[srca[i]] = i;
+				last_use[srcb[i]] = i;
+				break;
+		}
+		producer[oper->line] = i;
+	}
+	last_use[size - 1] = size;
+
+	for (r = 0; r < 16; r++) holder[r] = -1;
+
+	// push rbp; mov rbp, rsp; and rsp, -32; sub rsp, frame
+	emit(&as, 0x55);
+	emit(&as, 0x48); emit(&as, 0x89); emit(&as, 0xe5);
+	emit(&as, 0x48); emit(&as, 0x83); emit(&as, 0xe4); emit(&as, 0xe0);
+	emit(&as, 0x48); emit(&as, 0x81); emit(&as, 0xec);
+	frame_fixup = as.size;
+	emit32(&as, 0);
+
+	for (i = 0; i < size; i++) {
+		oper = sdf->func + i;
+
+		if (oper->code == CONST) {
+			where[i] = IN_POOL;
+			place[i] = pool_entry(pool, &pool_entries, pool_index, mask, oper->value);
+			continue;
+		}
+
+		// Get the operands into registers.
+		ra = rb = -1;
+		a = b = -1;
+		if ((oper->code != VAR_X) && (oper->code != VAR_Y)) {
+			a = srca[i];
+			if (where[a] == IN_REGISTER) {
+				ra = place[a];
+			} else {
+				ra = SCRATCH_A;
+				emit_load(&as, ra, (where[a] == ON_STACK) ? RSP : -1, (where[a] == ON_STACK) ? place[a] * 32 : place[a]);
+			}
+		}
+		if ((oper->code == ADD) || (oper->code == SUB) || (oper->code == MUL)
+				|| (oper->code == MAX) || (oper->code == MIN)
+				|| (oper->code == HYPOT) || (oper->code == MAX_NEG) || (oper->code == MIN_NEG)) {
+			b = srcb[i];
+			if (where[b] == IN_REGISTER) {
+				rb = place[b];
+			} else if (b == a) {
+				rb = ra;
+			} else {
+				rb = SCRATCH_B;
+				emit_load(&as, rb, (where[b] == ON_STACK) ? RSP : -1, (where[b] == ON_STACK) ? place[b] * 32 : place[b]);
+			}
+		}
+
+		// Operands read for the last time give up their homes before the result needs one.
+		if ((a >= 0) && (last_use[a] == i)) {
+			if (where[a] == IN_REGISTER) holder[place[a]] = -1;
+			if (where[a] == ON_STACK) free_stack[nfree_stack++] = place[a];
+		}
+		if ((b >= 0) && (b != a) && (last_use[b] == i)) {
+			if (where[b] == IN_REGISTER) holder[place[b]] = -1;
+			if (where[b] == ON_STACK) free_stack[nfree_stack++] = place[b];
+		}
+
+		// Find a register for the result, evicting whoever is needed last if we must.
+		dst = -1;
+		for (r = 0; r < JIT_REGISTERS; r++) {
+			if (holder[r] < 0) {
+				dst = r;
+				break;
+			}
+		}
+		if (dst < 0) {
+			dst = 0;
+			for (r = 1; r < JIT_REGISTERS; r++) {
+				if (last_use[holder[r]] > last_use[holder[dst]]) dst = r;
+			}
+			int victim = holder[dst];
+			where[victim] = ON_STACK;
+			place[victim] = nfree_stack ? free_stack[--nfree_stack] : stack_slots++;
+			emit_store(&as, dst, RSP, place[victim] * 32);
+		}
+		holder[dst] = i;
+		where[i] = IN_REGISTER;
+		place[i] = dst;
+
+		switch (oper->code) {
+			case VAR_X:
+				emit_load(&as, dst, RDI, 0);
+				break;
+			case VAR_Y:
+				emit_load(&as, dst, RSI, 0);
+				break;
+			case CONST:
+				break;
+			case NEG:
+				if (as.avx) {
+					emit_op_rm(&as, 0x57, dst, ra, -1, 0);   // xorpd with the sign bit
+				} else {
+					emit_move(&as, dst, ra);
+					emit_op_rm(&as, 0x57, dst, dst, -1, 0);
+				}
+				break;
+			case SQUARE:
+				emit_binary(&as, 0x59, dst, ra, ra);
+				break;
+			case SQRT:
+				emit_op_rr(&as, 0x51, dst, 0, ra);
+				break;
+			case ADD:
+				emit_binary(&as, 0x58, dst, ra, rb);
+				break;
+			case SUB:
+				emit_binary(&as, 0x5c, dst, ra, rb);
+				break;
+			case MUL:
+				emit_binary(&as, 0x59, dst, ra, rb);
+				break;
+			case MAX:
+				emit_binary(&as, 0x5f, dst, ra, rb);
+				break;
+			case MIN:
+				emit_binary(&as, 0x5d, dst, ra, rb);
+				break;
+			case HYPOT:
+				// b first: if a and b are the same spilled value, it's in SCRATCH_A.
+				emit_binary(&as, 0x59, SCRATCH_B, rb, rb);
+				emit_binary(&as, 0x59, SCRATCH_A, ra, ra);
+				emit_binary(&as, 0x58, SCRATCH_A, SCRATCH_A, SCRATCH_B);
+				emit_op_rr(&as, 0x51, dst, 0, SCRATCH_A);
+				break;
+			case MAX_NEG:
+			case MIN_NEG:
+				// Flip b into scratch before dst, which may be where b was, gets written.
+				if (as.avx) {
+					emit_op_rm(&as, 0x57, SCRATCH_B, rb, -1, 0);
+				} else {
+					emit_move(&as, SCRATCH_B, rb);
+					emit_op_rm(&as, 0x57, SCRATCH_B, SCRATCH_B, -1, 0);
+				}
+				emit_binary(&as, (oper->code == MAX_NEG) ? 0x5f : 0x5d, dst, ra, SCRATCH_B);
+				break;
+			case ADD_IMM:
+			case SUB_IMM:
+			case MUL_IMM:
+			case MAX_IMM:
+			case MIN_IMM:
+				r = pool_entry(pool, &pool_entries, pool_index, mask, oper->value);
+				if (as.avx) {
+					emit_op_rm(&as, imm_opcode[oper->code - ADD_IMM], dst, ra, -1, r);
+				} else {
+					emit_move(&as, dst, ra);
+					emit_op_rm(&as, imm_opcode[oper->code - ADD_IMM], dst, dst, -1, r);
+				}
+				break;
+			case IMM_SUB:
+				emit_load(&as, SCRATCH_B, -1, pool_entry(pool, &pool_entries, pool_index, mask, oper->value));
+				emit_binary(&as, 0x5c, dst, SCRATCH_B, ra);
+				break;
+		}
+
+		if (last_use[i] < 0) holder[dst] = -1;
+	}
+
+	// Hand back the last value.
+	i = size - 1;
+	if (where[i] == IN_REGISTER) {
+		r = place[i];
+	} else {
+		r = SCRATCH_A;
+		emit_load(&as, r, (where[i] == ON_STACK) ? RSP : -1, (where[i] == ON_STACK) ? place[i] * 32 : place[i]);
+	}
+	emit_store(&as, r, RDX, 0);
+
+	// mov rsp, rbp; pop rbp; vzeroupper; ret
+	emit(&as, 0x48); emit(&as, 0x89); emit(&as, 0xec);
+	emit(&as, 0x5d);
+	if (as.avx) {
+		emit(&as, 0xc5); emit(&as, 0xf8); emit(&as, 0x77);
+	}
+	emit(&as, 0xc3);
+
+	int frame = stack_slots * 32;
+	memcpy(as.code + frame_fixup, &frame, 4);
+
+	// The pool goes after the code, lined up for the vector loads.
+	int pool_start = (as.size + 31) & ~31;
+	for (i = 0; i < as.nfixups; i++) {
+		int32_t disp = pool_start + (as.pool_targets[i] * POOL_ENTRY) - (as.pool_fixups[i] + 4);
+		memcpy(as.code + as.pool_fixups[i], &disp, 4);
+	}
+
+	jit_code *jit = (jit_code *) malloc(sizeof(jit_code));
+	if (!jit) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	jit->width = as.avx ? 4 : 2;
+	jit->codesize = pool_start + (pool_entries * POOL_ENTRY);
+	jit->code = mmap((void *)0, jit->codesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		fprintf(stderr, "Unable to map memory for the JIT.\n");
+		free(jit);
+		jit = (jit_code *)0;
+	} else {
+		memcpy(jit->code, as.code, as.size);
+		memcpy((char *)jit->code + pool_start, pool, pool_entries * POOL_ENTRY);
+		if (mprotect(jit->code, jit->codesize, PROT_READ | PROT_EXEC)) {
+			fprintf(stderr, "Unable to make JIT code executable.\n");
+			munmap(jit->code, jit->codesize);
+			free(jit);
+			jit = (jit_code *)0;
+		} else {
+			jit->fn = (jit_fn) jit->code;
+			printf("JIT compiled %d operations to %d bytes of %s, %d stack slots, ",
+					size, as.size, as.avx ? "AVX2" : "SSE2", stack_slots);
+		}
+	}
+
+	free(as.code);
+	free(as.pool_fixups);
+	free(as.pool_targets);
+	free(producer);
+	free(srca);
+	free(srcb);
+	free(last_use);
+	free(where);
+	free(place);
+	free(free_stack);
+	free(pool);
+	free(pool_index);
+	return jit;
+}
+
+
+/* Release the code from jit_compile. */
+void jit_free(jit_code *jit) {
+	if (!jit) return;
+	munmap(jit->code, jit->codesize);
+	free(jit);
+}
+
+
+/* Render every pixel of the image with both the interpreter and the JIT, and complain
+ * about every pixel where the two don't agree down to the last bit.
+ * Returns the number of pixels that differ. */
+int compare_jit(func *sdf, fp_type *space, int size) {
+	fp_type xs[BLOCK_SIZE], ys[BLOCK_SIZE], interp[BLOCK_SIZE], native[BLOCK_SIZE];
+	int mismatches = 0;
+	long total = (long) size * size;
+	fp_type *scratch = (fp_type *) malloc(sizeof(fp_type) * sdf->slots * BLOCK_SIZE);
+	if (!scratch) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+
+	for (long start = 0; start < total; start += BLOCK_SIZE) {
+		int n = (total - start < BLOCK_SIZE) ? total - start : BLOCK_SIZE;
+		for (int j = 0; j < BLOCK_SIZE; j++) {
+			long pixel = start + ((j < n) ? j : n - 1);
+			xs[j] = space[pixel % size];
+			ys[j] = -space[pixel / size];
+		}
+		render_block(sdf, scratch, xs, ys, interp);
+		for (int j = 0; j < n; j += sdf->jit->width) {
+			sdf->jit->fn(xs + j, ys + j, native + j);
+		}
+		for (int j = 0; j < n; j++) {
+			if (memcmp(&native[j], &interp[j], sizeof(fp_type))) {
+				if (mismatches < 10) {
+					fprintf(stderr, "Pixel %ld, %ld: interpreter %.17g, JIT %.17g\n",
+							(start + j) % size, (start + j) / size, interp[j], native[j]);
+				}
+				mismatches++;
+			}
+		}
+	}
+
+	free(scratch);
+	return mismatches;
+}
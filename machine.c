@@ -16,474 +16,2084 @@
 #include <math.h> 
 #include <time.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <sys/stat.h>
 
-#define START_TIMER clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_time);
-#define PRINT_TIMER clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end_time); \
-printf("cpu time: %f", (end_time.tv_sec - start_time.tv_sec) + ((end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0));
-
-/* Render the image. Options in machine.h */ 
-int main(int argc, char** argv) {
+/* load_func, for a program that has to keep going when the file is no good, like the 
+ * server. What was wrong goes in error, at most errsize bytes of it.
+ * Returns the func, or 0 if it couldn't be loaded. */
+func *try_load_func(const char *filename, int verbose, char *error, int errsize) {
 	struct timespec start_time, end_time;
-	int opcount;
+	int opcount, loaded;
+	optimize_stats stats;
+	fuse_stats fstats;
+	uint64_t source = 0;
+	char cachefile[4096];
+	func *sdf = (func *) malloc(sizeof(func));
+	if (!sdf) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
 
-	fp_type* space = linspace(IMAGE_SIZE);
 	START_TIMER
-	func sdf = parse_file(FILENAME);
-	PRINT_TIMER
-	printf("\n");
-	
-	printf("Constant folding is %s, ", FOLD_CONST ? "enabled" : "disabled");
-	if (FOLD_CONST) {
-		START_TIMER
-		opcount = fold_const(&sdf);
-		printf("converted %d operations to const loads, ", opcount);
+	struct stat st;
+	if (stat(filename, &st) || !S_ISREG(st.st_mode) || access(filename, R_OK)) {
+		snprintf(error, errsize, "can't read %s, or it isn't a file", filename);
+		free(sdf);
+		return (func *)0;
+	}
+	loaded = load_tape(filename, sdf, 0);
+	if (loaded == 0) {
+		snprintf(error, errsize, "%s: tape is no good to this build", filename);
+		free(sdf);
+		return (func *)0;
+	}
+	if ((loaded < 0) && TAPE_CACHE) {
+		if (!hash_file(filename, &source)) {
+			snprintf(error, errsize, "can't read %s", filename);
+			free(sdf);
+			return (func *)0;
+		}
+		tape_cache_path(cachefile, sizeof(cachefile), source);
+		loaded = load_tape(cachefile, sdf, source);
+	}
+	if (loaded > 0) {
+		if (verbose) {
+			printf("Loaded tape for %s, instruction count: %d, %d scratch slots, ", filename, sdf->size, sdf->slots);
+			PRINT_TIMER
+			printf("\n");
+		}
+		if (PACKED) pack_func(sdf);
+		separate_func(sdf);
+		return sdf;
+	}
+
+	if (!parse_func(filename, sdf, error, errsize)) {
+		free(sdf);
+		return (func *)0;
+	}
+	if (verbose) {
+		printf("Parsing file: %s, instruction count: %d, ", filename, sdf->size);
 		PRINT_TIMER
+		printf("\n");
+		printf("Optimization is %s, ", OPTIMIZE ? "enabled" : "disabled");
 	}
-	printf("\n");
 
-	printf("Const instruction removal is %s, ", CUT_CONST ? "enabled" : "disabled");
-	if (CUT_CONST) {
+	if (OPTIMIZE) {
 		START_TIMER
-		opcount = cut_const(&sdf);
-		printf("removed %d const instructions from program, ", opcount);
-		PRINT_TIMER
+		opcount = sdf->size;
+		optimize(sdf, &stats);
+		if (verbose) {
+			printf("%d instructions down to %d (%d folded, %d merged, %d rewritten, %d dead), ", 
+					opcount, sdf->size, stats.folded, stats.merged, stats.rewritten, stats.dead);
+			PRINT_TIMER
+		}
+	}
+
+	if (verbose) {
+		printf("\n");
+		printf("Fusion is %s, ", FUSE ? "enabled" : "disabled");
+	}
+	if (FUSE) {
+		START_TIMER
+		opcount = sdf->size;
+		fuse(sdf, &fstats);
+		if (verbose) {
+			printf("%d instructions down to %d (%d hypot, %d max_neg, %d min_neg), ", 
+					opcount, sdf->size, fstats.hypot, fstats.max_neg, fstats.min_neg);
+			PRINT_TIMER
+		}
+	}
+
+	if (verbose) {
+		printf("\n");
+		printf("Immediate operands are %s, ", IMMEDIATES ? "enabled" : "disabled");
+	}
+	if (IMMEDIATES) {
+		START_TIMER
+		opcount = lower_immediates(sdf);
+		if (verbose) {
+			printf("removed %d const instructions from program, ", opcount);
+			PRINT_TIMER
+		}
+	}
+
+	if (verbose) {
+		printf("\n");
+		printf("Register allocation is %s, ", REGISTER_ALLOC ? "enabled" : "disabled");
+	}
+	if (REGISTER_ALLOC) {
+		START_TIMER
+		opcount = allocate_registers(sdf);
+		if (verbose) {
+			printf("%d scratch slots, peak live count %d, ", sdf->slots, opcount);
+			PRINT_TIMER
+		}
+	}
+
+	if (verbose) {
+		printf("\n");
+		printf("Packing is %s, ", PACKED ? "enabled" : "disabled");
+	}
+	if (PACKED) {
+		START_TIMER
+		opcount = pack_func(sdf);
+		if (verbose) {
+			if (opcount) printf("%d bytes per instruction instead of %d, ", (int) sizeof(packed_op), (int) sizeof(operation));
+			else printf("too many slots or constants to pack, ");
+			PRINT_TIMER
+		}
+	}
+
+	if (verbose) {
+		printf("\n");
+		printf("Hoisting is %s, ", HOIST_SEPARABLE ? "enabled" : "disabled");
+	}
+	if (HOIST_SEPARABLE) {
+		START_TIMER
+		separate_func(sdf);
+		if (verbose) {
+			if (sdf->sorted) printf("%d instructions need x or nothing, %d y, ", sdf->sorted->xops, sdf->sorted->yops);
+			else printf("not enough only needs x or y to bother, ");
+			PRINT_TIMER
+		}
+	} else {
+		sdf->sorted = (func *)0;
+	}
+	if (verbose) printf("\n");
+
+	// Somewhere to keep it for next time. Not being able to is no reason to stop.
+	if (TAPE_CACHE) {
+		mkdir(TAPE_CACHE_DIR, 0755);
+		if (!write_tape(cachefile, sdf, source) && verbose) {
+			printf("Couldn't write tape cache %s\n", cachefile);
+		}
+	}
+	return sdf;
+}
+
+
+/* Load a function from filename and put it through the passes configured in machine.h.
+ * filename can be a tape from write_tape, which has been through them already. With 
+ * TAPE_CACHE, a .vm file that has been seen before is loaded from the cached tape.
+ * With verbose, report on each pass as it goes. Quits if the file is no good.
+ * Returns a func ready to hand to render_view. Free it with free_func. */
+func *load_func(const char *filename, int verbose) {
+	char error[PARSE_ERROR_SIZE];
+	func *sdf = try_load_func(filename, verbose, error, sizeof(error));
+	if (!sdf) {
+		fprintf(stderr, "%s\n", error);
+		exit(1);
+	}
+	return sdf;
+}
+
+
+/* Free a func from load_func, and the JIT code and sorted copy hanging off it if any. */
+void free_func(func *sdf) {
+	jit_free(sdf->jit);
+	if (sdf->sorted) {
+		free(sdf->sorted->func);
+		free(sdf->sorted);
+	}
+	if (sdf->mapping) {
+		munmap(sdf->mapping, sdf->mapsize);
+	} else {
+		free(sdf->func);
+	}
+	free(sdf->packed);
+	free(sdf->pool);
+	free(sdf);
+}
+
+
+/* Start up a renderer with num_threads worker threads, or none to render on the 
+ * calling thread, pinned to CPUs if pin is set. The workers and their scratch memory 
+ * stick around between renders, so rendering frame after frame doesn't pay to set 
+ * them up every time. */
+static renderer *new_renderer(int num_threads, int pin) {
+	renderer *r = (renderer *) malloc(sizeof(renderer));
+	if (!r) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	r->threaded = (num_threads > 0);
+	r->num_workers = r->threaded ? num_threads : 1;
+	r->workers = (worker *) malloc(sizeof(worker) * r->num_workers);
+	r->deques = (tile_deque *) malloc(sizeof(tile_deque) * r->num_workers);
+	if (!(r->workers && r->deques)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	r->generation = 0;
+	r->running = 0;
+	r->quit = 0;
+	r->job.deques = r->deques;
+	r->job.num_workers = r->num_workers;
+	r->job.mask = (char *)0;
+	r->job.bits = 0;
+	r->job.tiles = (const int *)0;
+	r->job.parts = (const render_job *)0;
+	r->job.heat = (float *)0;
+	r->wall = 0;
+	r->heat = (float *)0;
+	r->num_nodes = 1;
+	r->tapes = (node_tape *)0;
+	pthread_mutex_init(&r->busy, NULL);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->start, NULL);
+	pthread_cond_init(&r->finish, NULL);
+
+	// More workers than CPUs aren't pinned at all, two to a CPU would be worse than
+	// letting the scheduler sort it out. The deques start each worker on a run of
+	// tiles next to the next worker's, so workers on the same node share a band.
+	int *cpus = (int *) malloc(sizeof(int) * r->num_workers);
+	int *nodes = (int *) malloc(sizeof(int) * r->num_workers);
+	int ncpus = 0, seen[MAX_NODES];
+	if (!(cpus && nodes)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	if (pin && r->threaded) ncpus = cpu_order(cpus, nodes, r->num_workers);
+	if (ncpus < r->num_workers) ncpus = 0;
+	r->num_nodes = 0;
+	for (int i = 0; i < r->num_workers; i++) {
+		r->workers[i].cpu = ncpus ? cpus[i] : -1;
+		r->workers[i].node = 0;
+		if (!ncpus) continue;
+		int k;
+		for (k = 0; (k < r->num_nodes) && (seen[k] != nodes[i]); k++);
+		if (k == r->num_nodes) seen[r->num_nodes++] = nodes[i];
+		r->workers[i].node = k;
+	}
+	if (!r->num_nodes) r->num_nodes = 1;
+	free(cpus);
+	free(nodes);
+	if (REPLICATE_TAPE && (r->num_nodes > 1)) {
+		r->tapes = (node_tape *) calloc(r->num_nodes, sizeof(node_tape));
+		if (!r->tapes) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		for (int i = 0; i < r->num_nodes; i++) pthread_mutex_init(&r->tapes[i].lock, NULL);
+	}
+
+	for (int i = 0; i < r->num_workers; i++) {
+		pthread_mutex_init(&r->deques[i].lock, NULL);
+		r->workers[i].owner = r;
+		r->workers[i].id = i;
+		scratchpad_init(&r->workers[i].pad);
+		profile_init(&r->workers[i].prof);
+		r->workers[i].pad.prof = &r->workers[i].prof;
+		if (r->threaded && pthread_create(&r->workers[i].thread, NULL, start_thread, &r->workers[i])) {
+			fprintf(stderr, "Problem creating thread\n");
+			exit(1);
+		}
+	}
+	return r;
+}
+
+
+/* A renderer for a library caller, which might have others, or other programs, on the
+ * same machine: the workers go wherever the scheduler puts them.
+ * Free with free_renderer. */
+renderer *create_renderer(int num_threads) {
+	return new_renderer(num_threads, 0);
+}
+
+
+/* A renderer for a program that has the machine to itself, with PIN_THREADS the
+ * workers pinned a CPU each, see new_renderer. Free with free_renderer. */
+renderer *create_pinned_renderer(int num_threads) {
+	return new_renderer(num_threads, PIN_THREADS);
+}
+
+
+/* Stop the workers and free everything that belongs to the renderer. */
+void free_renderer(renderer *r) {
+	int i;
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	pthread_cond_broadcast(&r->start);
+	pthread_mutex_unlock(&r->lock);
+
+	for (i = 0; i < r->num_workers; i++) {
+		if (r->threaded && pthread_join(r->workers[i].thread, NULL)) {
+			fprintf(stderr, "Problem joining threads\n");
+			exit(1);
+		}
+		scratchpad_free(&r->workers[i].pad);
+		profile_free(&r->workers[i].prof);
+		pthread_mutex_destroy(&r->deques[i].lock);
+	}
+	pthread_mutex_destroy(&r->busy);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->start);
+	pthread_cond_destroy(&r->finish);
+	free_node_tapes(r);
+	free(r->workers);
+	free(r->deques);
+	free(r);
+}
+
+
+/* Work out the coordinates of every column and row of a width by height image of view. 
+ * Caller must free both. */
+void view_axes(const viewport *view, int width, int height, fp_type **xspace, fp_type **yspace) {
+	// Pixels are square, the view is 2 * scale across.
+	fp_type step = (2.0 * view->scale) / width;
+	*xspace = axis(view->x - view->scale, step, width);
+	*yspace = axis(-(view->y + (step * height / 2)), step, height);
+
+	// Pixel rows run top down, but y runs bottom up, hence the flip.
+	for (int i = 0; i < height; i++) (*yspace)[i] = -(*yspace)[i];
+}
+
+
+/* Share ntasks tasks of the job out between the workers' deques, a contiguous run 
+ * each, and wait while they get done. Caller holds r->busy and has filled in r->job. */
+static void run_job(renderer *r, int ntasks) {
+	double start = PROFILE ? profile_clock() : 0;
+	for (int i = 0; i < r->num_workers; i++) {
+		r->deques[i].head = (int) (((long) ntasks * i) / r->num_workers);
+		r->deques[i].tail = (int) (((long) ntasks * (i + 1)) / r->num_workers);
+	}
+
+	if (r->threaded) {
+		pthread_mutex_lock(&r->lock);
+		r->running = r->num_workers;
+		r->generation++;
+		pthread_cond_broadcast(&r->start);
+		while (r->running) pthread_cond_wait(&r->finish, &r->lock);
+		pthread_mutex_unlock(&r->lock);
+	} else {
+		render_tiles(&r->job, 0, &r->workers[0].pad);
+	}
+	if (PROFILE) r->wall += profile_clock() - start;
+}
+
+
+/* Render a width by height image of the part of the plane at xspace and yspace into 
+ * data, with the workers. With bits, data is a mask like render_mask's rather than 
+ * a byte a pixel. With tiles, only the ntiles tiles listed get rendered, numbered 
+ * across then down, and the rest of data is left alone. Caller holds r->busy. */
+static void render_grid(renderer *r, func *sdf, const fp_type *xspace, const fp_type *yspace, int width, int height, int precision, 
+		char *data, int bits, const int *tiles, int ntiles) {
+	render_job *job = &r->job;
+	job->sdf = sdf;
+	job->xspace = xspace;
+	job->yspace = yspace;
+	job->data = data;
+	job->width = width;
+	job->height = height;
+	job->tile_size = TILE_SIZE;
+	job->tiles_across = (width + TILE_SIZE - 1) / TILE_SIZE;
+	job->tiles_down = (height + TILE_SIZE - 1) / TILE_SIZE;
+	job->precision = precision;
+	job->mask = (char *)0;
+	job->bits = bits;
+	job->tiles = tiles;
+	job->parts = (const render_job *)0;
+	job->heat = r->heat;
+	run_job(r, tiles ? ntiles : job->tiles_across * job->tiles_down);
+}
+
+
+/* Render the part of the plane described by view into a width by height image in data.
+ *
+ * The image is cut into TILE_SIZE square tiles, and each worker starts out with a 
+ * deque holding a contiguous run of them. Workers take tiles off the back of their own 
+ * deque, and when it runs dry, steal from the front of somebody else's, so nobody sits 
+ * around while there is work left, no matter how lopsided the image is.
+ *
+ * Safe to call from several threads at once, renders on the same renderer just take 
+ * turns. Returns once every pixel is done. */
+int render_view(renderer *r, func *sdf, const viewport *view, int width, int height, int precision, char *data) {
+	fp_type *xspace, *yspace;
+	view_axes(view, width, height, &xspace, &yspace);
+
+	pthread_mutex_lock(&r->busy);
+	render_grid(r, sdf, xspace, yspace, width, height, precision, data, 0, (const int *)0, 0);
+	pthread_mutex_unlock(&r->busy);
+
+	free(xspace);
+	free(yspace);
+	return 0;
+}
+
+
+/* render_view, but into a bit a pixel instead of a byte, laid out the way a PBM file 
+ * has them: every row starts on a byte and takes MASK_STRIDE(width) of them, the 
+ * first pixel in the top bit, and a 1 for black, which is outside. That's an eighth 
+ * of the memory, and the same again off the bandwidth it takes to write it out. 
+ * bits is MASK_STRIDE(width) * height bytes. */
+int render_mask(renderer *r, func *sdf, const viewport *view, int width, int height, int precision, unsigned char *bits) {
+	fp_type *xspace, *yspace;
+	view_axes(view, width, height, &xspace, &yspace);
+
+	pthread_mutex_lock(&r->busy);
+	render_grid(r, sdf, xspace, yspace, width, height, precision, (char *) bits, 1, (const int *)0, 0);
+	pthread_mutex_unlock(&r->busy);
+
+	free(xspace);
+	free(yspace);
+	return 0;
+}
+
+
+/* Render a batch of n views with the workers, each into the mask like render_mask's 
+ * at its data. Every tile of every view goes into one job, so the workers share them 
+ * out as if they were all one big image, and a little view at the end of the list 
+ * doesn't leave anybody waiting on it. No views is nothing to do. */
+int render_views(renderer *r, func *sdf, int n, batch_view *views, int precision) {
+	int i, ntiles = 0;
+	if (n < 1) return 0;
+	render_job *parts = (render_job *) calloc(n, sizeof(render_job));
+	if (!parts) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		fp_type *xspace, *yspace;
+		render_job *part = parts + i;
+		view_axes(&views[i].view, views[i].width, views[i].height, &xspace, &yspace);
+		part->xspace = xspace;
+		part->yspace = yspace;
+		part->data = (char *) views[i].data;
+		part->width = views[i].width;
+		part->height = views[i].height;
+		part->tile_size = TILE_SIZE;
+		part->tiles_across = (part->width + TILE_SIZE - 1) / TILE_SIZE;
+		part->tiles_down = (part->height + TILE_SIZE - 1) / TILE_SIZE;
+		part->bits = 1;
+		part->first_tile = ntiles;
+		ntiles += part->tiles_across * part->tiles_down;
+	}
+
+	pthread_mutex_lock(&r->busy);
+	render_job *job = &r->job;
+	job->sdf = sdf;
+	job->precision = precision;
+	job->mask = (char *)0;
+	job->tiles = (const int *)0;
+	job->parts = parts;
+	job->nparts = n;
+	job->heat = (float *)0;
+	run_job(r, ntiles);
+	job->parts = (const render_job *)0;
+	pthread_mutex_unlock(&r->busy);
+
+	for (i = 0; i < n; i++) {
+		free((void *) parts[i].xspace);
+		free((void *) parts[i].yspace);
+	}
+	free(parts);
+	return 0;
+}
+
+
+/* Render just the ntiles TILE_SIZE tiles listed in tiles, numbered across then down, 
+ * of a width by height mask like render_mask's, with columns and rows at xspace and 
+ * yspace. The rest of bits is left as it was. For filling the holes in an image 
+ * put together from tiles rendered before. */
+int render_tile_set(renderer *r, func *sdf, const fp_type *xspace, const fp_type *yspace, int width, int height, int precision, 
+		unsigned char *bits, const int *tiles, int ntiles) {
+	pthread_mutex_lock(&r->busy);
+	render_grid(r, sdf, xspace, yspace, width, height, precision, (char *) bits, 1, tiles, ntiles);
+	pthread_mutex_unlock(&r->busy);
+	return 0;
+}
+
+
+/* render_view a bit at a time, for something to look at long before it's finished.
+ *
+ * The first pass renders every PROGRESSIVE_STEPth pixel of every PROGRESSIVE_STEPth 
+ * row, and blows each of them up into a square that size. Every pass after that halves 
+ * the spacing. A pixel is never worked out twice, and of the ones in a pass that 
+ * haven't been, only those in or next to a square from the last pass whose corners 
+ * don't agree get done, the rest keep the value of the square they're in. The pixels 
+ * to do are marked NEED_PIXEL in a mask the size of the image, and the workers go 
+ * through it a tile at a time with render_masked, so interval culling and simplified 
+ * tapes work here the same as they do for render_chunk. After every pass, callback 
+ * (if there is one) gets the whole image so far, and can stop the render by returning 
+ * nonzero.
+ *
+ * Anything small enough to fit between the pixels of a pass without reaching an 
+ * edge it saw won't show up in that pass's preview. The last pass doesn't guess, it 
+ * does every pixel nothing has settled yet, so the finished image is the same as 
+ * render_view's. Squares the intervals settle on the way count as settled, which 
+ * leaves the last pass not much more than the edges to do.
+ * Returns the number of passes done. */
+int render_progressive(renderer *r, func *sdf, const viewport *view, int width, int height, int precision, 
+		char *data, progress_fn callback, void *user) {
+	fp_type *xspace, *yspace;
+	int step = PROGRESSIVE_STEP, last = 0, passes = 0;
+	int i, j, cw = 0, ch = 0;
+	long p;
+	view_axes(view, width, height, &xspace, &yspace);
+
+	char *mask = (char *) calloc((long) width * height, 1);
+	char *edge = (char *) malloc(((long) (width / 2 + 1)) * (height / 2 + 1));
+	if (!(mask && edge)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+
+	pthread_mutex_lock(&r->busy);
+	while (step >= 1) {
+		if (last) {
+			// The squares from the last pass, and whether their corners agree.
+			cw = (width + last - 1) / last;
+			ch = (height + last - 1) / last;
+			for (j = 0; j < ch; j++) {
+				for (i = 0; i < cw; i++) {
+					char *corner = data + ((long) j * last * width) + (i * last);
+					char v = corner[0];
+					int right = (i + 1 < cw), down = (j + 1 < ch);
+					edge[((long) j * cw) + i] = (right && (corner[last] != v)) || (down && (corner[(long) last * width] != v))
+							|| (right && down && (corner[((long) last * width) + last] != v));
+				}
+			}
+		}
+
+		// Mark the pixels this pass that haven't been done, and are in or next to a 
+		// square with an edge in it. All of them, first and last time round.
+		for (j = 0; j * step < height; j++) {
+			for (i = 0; i * step < width; i++) {
+				p = ((long) j * step * width) + (i * step);
+				if (mask[p] == KNOWN_PIXEL) continue;
+				int near = !last || (step == 1);
+				for (int dj = -1; (dj <= 1) && !near; dj++) {
+					for (int di = -1; (di <= 1) && !near; di++) {
+						int ni = (i / 2) + di, nj = (j / 2) + dj;
+						near = (ni >= 0) && (ni < cw) && (nj >= 0) && (nj < ch) && edge[((long) nj * cw) + ni];
+					}
+				}
+				if (near) mask[p] = NEED_PIXEL;
+			}
+		}
+
+		render_job *job = &r->job;
+		job->sdf = sdf;
+		job->xspace = xspace;
+		job->yspace = yspace;
+		job->data = data;
+		job->width = width;
+		job->height = height;
+		// Tiles with as many pixels to do as a full one would have at the end.
+		job->tile_size = TILE_SIZE * step;
+		job->tiles_across = (width + job->tile_size - 1) / job->tile_size;
+		job->tiles_down = (height + job->tile_size - 1) / job->tile_size;
+		job->precision = precision;
+		job->mask = mask;
+		job->bits = 0;
+		job->tiles = (const int *)0;
+		job->parts = (const render_job *)0;
+		job->heat = (float *)0;
+		run_job(r, job->tiles_across * job->tiles_down);
+		job->mask = (char *)0;
+
+		// Blow the new ones up to fill their squares, around anything the intervals 
+		// already settled. The rest already have the value of their square, from the 
+		// last time round.
+		for (j = 0; j * step < height; j++) {
+			for (i = 0; i * step < width; i++) {
+				p = ((long) j * step * width) + (i * step);
+				if (mask[p] != NEED_PIXEL) continue;
+				mask[p] = KNOWN_PIXEL;
+				int w = (width - (i * step) < step) ? width - (i * step) : step;
+				int h = (height - (j * step) < step) ? height - (j * step) : step;
+				for (int row = 0; row < h; row++) {
+					for (int col = 0; col < w; col++) {
+						long q = p + ((long) row * width) + col;
+						if (mask[q] != KNOWN_PIXEL) data[q] = data[p];
+					}
+				}
+			}
+		}
+
+		passes++;
+		if (callback && callback(data, width, height, step, user)) break;
+		last = step;
+		step /= 2;
+	}
+	pthread_mutex_unlock(&r->busy);
+
+	free(mask);
+	free(edge);
+	free(xspace);
+	free(yspace);
+	return passes;
+}
+
+
+// Hands finished bands of render_stream to a thread of its own to write out
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	const char *band;	// waiting to be written, null when the writer is idle
+	long size;
+	off_t offset;
+	int quit;
+	int failed;
+} band_writer;
+
+
+/* Write size bytes of data to fd at offset, however many goes it takes. */
+static int write_at(int fd, const char *data, long size, off_t offset) {
+	while (size > 0) {
+		ssize_t done = pwrite(fd, data, size, offset);
+		if (done < 0) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		data += done;
+		size -= done;
+		offset += done;
+	}
+	return 1;
+}
+
+
+static void *start_writer(void *args) {
+	band_writer *w = (band_writer *) args;
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (!w->band && !w->quit) pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->band) break;
+		pthread_mutex_unlock(&w->lock);
+		int ok = write_at(w->fd, w->band, w->size, w->offset);
+		pthread_mutex_lock(&w->lock);
+		if (!ok) w->failed = 1;
+		w->band = (const char *)0;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return (void *)0;
+}
+
+
+/* Wait for the writer to finish the band it's on. */
+static void writer_wait(band_writer *w) {
+	pthread_mutex_lock(&w->lock);
+	while (w->band) pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+/* render_view straight into an image file, for images too big to keep in memory.
+ *
+ * The image is rendered STREAM_ROWS rows at a time, each band with all the workers 
+ * the way render_view does a whole image, into one of two buffers. While one band 
+ * is being rendered, a thread of its own writes the last one out to its place in 
+ * the file with pwrite, so the disk and the workers keep each other busy, and no 
+ * more than two bands are ever in memory. With bits, the file is a PBM made the way 
+ * render_mask would, otherwise a PGM. Returns 1 if the file got written. */
+int render_stream(renderer *r, func *sdf, const viewport *view, int width, int height, int precision, const char *filename, int bits) {
+	fp_type *xspace, *yspace;
+	band_writer writer;
+	char header[64];
+	int rows = (height < STREAM_ROWS) ? height : STREAM_ROWS;
+	long stride = bits ? MASK_STRIDE(width) : width;
+	long band_size = stride * rows;
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s for writing\n", filename);
+		return 0;
+	}
+	int header_size = bits ? snprintf(header, sizeof(header), "P4\n%d %d\n", width, height)
+			: snprintf(header, sizeof(header), "P5\n%d %d\n255\n", width, height);
+	// Full size up front, so running out of room shows up now rather than halfway.
+	if (!write_at(fd, header, header_size, 0) || ftruncate(fd, header_size + ((off_t) stride * height))) {
+		fprintf(stderr, "Unable to write %s\n", filename);
+		close(fd);
+		return 0;
+	}
+
+	char *bands[2];
+	for (int i = 0; i < 2; i++) {
+		if (posix_memalign((void **) &bands[i], 64, band_size)) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+	}
+	view_axes(view, width, height, &xspace, &yspace);
+
+	memset(&writer, 0, sizeof(writer));
+	writer.fd = fd;
+	pthread_mutex_init(&writer.lock, NULL);
+	pthread_cond_init(&writer.cond, NULL);
+	if (pthread_create(&writer.thread, NULL, start_writer, &writer)) {
+		fprintf(stderr, "Problem creating thread\n");
+		exit(1);
+	}
+
+	pthread_mutex_lock(&r->busy);
+	for (int y = 0, n = 0; y < height; y += rows, n++) {
+		int h = (height - y < rows) ? height - y : rows;
+		char *band = bands[n % 2];
+		render_grid(r, sdf, xspace, yspace + y, width, h, precision, band, bits, (const int *)0, 0);
+
+		// The writer is done with the other buffer once it's idle.
+		writer_wait(&writer);
+		pthread_mutex_lock(&writer.lock);
+		if (writer.failed) {
+			pthread_mutex_unlock(&writer.lock);
+			break;
+		}
+		writer.band = band;
+		writer.size = stride * h;
+		writer.offset = header_size + ((off_t) y * stride);
+		pthread_cond_broadcast(&writer.cond);
+		pthread_mutex_unlock(&writer.lock);
+	}
+	pthread_mutex_unlock(&r->busy);
+
+	pthread_mutex_lock(&writer.lock);
+	writer.quit = 1;
+	pthread_cond_broadcast(&writer.cond);
+	pthread_mutex_unlock(&writer.lock);
+	if (pthread_join(writer.thread, NULL)) {
+		fprintf(stderr, "Problem joining threads\n");
+		exit(1);
+	}
+	pthread_mutex_destroy(&writer.lock);
+	pthread_cond_destroy(&writer.cond);
+
+	int ok = !writer.failed && (close(fd) == 0);
+	if (writer.failed) close(fd);
+	if (!ok) fprintf(stderr, "Unable to write %s\n", filename);
+	free(bands[0]);
+	free(bands[1]);
+	free(xspace);
+	free(yspace);
+	return ok;
+}
+
+
+/* Get the next tile for worker id to render, stealing one if its own deque is empty.
+ * Returns -1 when there is nothing left anywhere. */
+int next_tile(render_job *job, int id) {
+	tile_deque *deque = job->deques + id;
+	int tile = -1;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->head < deque->tail) tile = --deque->tail;
+	pthread_mutex_unlock(&deque->lock);
+	if (tile >= 0) return tile;
+
+	for (int i = 1; i < job->num_workers; i++) {
+		deque = job->deques + ((id + i) % job->num_workers);
+		pthread_mutex_lock(&deque->lock);
+		if (deque->head < deque->tail) tile = deque->head++;
+		pthread_mutex_unlock(&deque->lock);
+		if (tile >= 0) return tile;
+	}
+	return -1;
+}
+
+
+/* Worker thread for a renderer. Sleeps until there is a render on, helps with it, 
+ * and goes back to sleep, until the renderer is freed. With its node's own copy of 
+ * the function, if there's more than one node. */
+void *start_thread(void * args_in) {
+	worker * self = (worker *)args_in;
+	renderer * r = self->owner;
+	render_job local;
+	int seen = 0;
+
+	// Before anything else, so the scratchpad goes on this CPU's node.
+	if (self->cpu >= 0) pin_thread(self->cpu);
+
+	while (1) {
+		pthread_mutex_lock(&r->lock);
+		while ((r->generation == seen) && !r->quit) pthread_cond_wait(&r->start, &r->lock);
+		if (r->quit) {
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		seen = r->generation;
+		pthread_mutex_unlock(&r->lock);
+
+		if (r->tapes) {
+			local = r->job;
+			local.sdf = node_func(r, self->node, r->job.sdf, seen);
+			render_tiles(&local, self->id, &self->pad);
+		} else {
+			render_tiles(&r->job, self->id, &self->pad);
+		}
+
+		pthread_mutex_lock(&r->lock);
+		if (--r->running == 0) pthread_cond_signal(&r->finish);
+		pthread_mutex_unlock(&r->lock);
+	}
+	return (void *)0;
+}
+
+
+/* Render tiles of the job as worker id until there are none left. Each tile is 
+ * rendered into a buffer of its own, then copied into the image a row at a time, so 
+ * threads never write into the same cache lines as each other while they work. For 
+ * a mask, the rows get packed down to bits on the way, and since tiles are a whole 
+ * number of bytes across, no two threads ever write the same byte. 
+ * A pass of render_progressive only touches a few pixels, and writes them in place. */
+int render_tiles(render_job *job, int id, scratchpad *pad) {
+	char tile[TILE_SIZE * TILE_SIZE];
+	int t;
+
+	scratchpad_reserve(pad, job->sdf, job->precision);
+	while ((t = next_tile(job, id)) >= 0) {
+		const render_job *at = job;
+		if (job->tiles) t = job->tiles[t];
+		if (job->parts) {
+			// The last image to start at or before tile t.
+			int lo = 0, hi = job->nparts - 1;
+			while (lo < hi) {
+				int mid = (lo + hi + 1) / 2;
+				if (job->parts[mid].first_tile <= t) lo = mid;
+				else hi = mid - 1;
+			}
+			at = job->parts + lo;
+			t -= at->first_tile;
+		}
+		int x = (t % at->tiles_across) * at->tile_size;
+		int y = (t / at->tiles_across) * at->tile_size;
+		int w = (at->width - x < at->tile_size) ? at->width - x : at->tile_size;
+		int h = (at->height - y < at->tile_size) ? at->height - y : at->tile_size;
+		double start = 0;
+		if (PROFILE && pad->prof) {
+			start = profile_clock();
+			profile_start(pad->prof);
+		}
+		if (at->mask) {
+			long corner = ((long) y * at->width) + x;
+			render_masked(job->sdf, pad, x, y, w, h, at->mask + corner, at->data + corner, at->width, at->xspace, at->yspace);
+		} else {
+			render_chunk(job->sdf, pad, x, y, w, h, tile, w, at->xspace, at->yspace);
+		}
+		if (PROFILE && pad->prof) {
+			profile_stop(pad->prof);
+			double took = profile_clock() - start;
+			pad->prof->busy += took;
+			pad->prof->tiles++;
+			if (job->heat) job->heat[t] = (float) took;
+		}
+		if (at->mask) continue;
+		for (int row = 0; row < h; row++) {
+			if (at->bits) {
+				pack_mask_row(tile + (row * w), w, (unsigned char *) at->data + ((long) (y + row) * MASK_STRIDE(at->width)) + (x / 8));
+			} else {
+				memcpy(at->data + ((long) (y + row) * at->width) + x, tile + (row * w), w);
+			}
+		}
+	}
+	return 0;
+}
+
+
+/* Start a thread's working memory out empty. */
+void scratchpad_init(scratchpad *pad) {
+	memset(pad, 0, sizeof(scratchpad));
+}
+
+
+// Bytes to take from a scratchpad's arena for n of size each, rounded up to a cache line
+#define CARVE(n, size) ((((size_t) (n) * (size)) + 63) & ~(size_t) 63)
+
+
+/* Make sure a thread's working memory is big enough to render sdf, and get it ready to. 
+ * It only ever grows, so a renderer that sees the same function over and over 
+ * allocates once. It all comes out of one arena from arena_alloc, every array on a 
+ * cache line of its own, and the thread that calls this is the one whose node it 
+ * ends up on. */
+int scratchpad_reserve(scratchpad *pad, func *sdf, int precision) {
+	int n = (sdf->size > sdf->slots) ? sdf->size : sdf->slots;
+	// The hoisting caches only ever hold the x and y parts of the sorted copy.
+	int hx = (HOIST_SEPARABLE && sdf->sorted) ? sdf->sorted->xops : 0;
+	int hy = (HOIST_SEPARABLE && sdf->sorted) ? sdf->sorted->yops : 0;
+	if ((sdf->slots > pad->slots) || (n > pad->ops) || (hx > pad->hoist_x) || (hy > pad->hoist_y)) {
+		if (pad->hoist_x > hx) hx = pad->hoist_x;
+		if (pad->hoist_y > hy) hy = pad->hoist_y;
+		if (pad->ops > n) n = pad->ops;
+		int slots = (pad->slots > sdf->slots) ? pad->slots : sdf->slots;
+		scratchpad_free(pad);
+		pad->slots = slots;
+		pad->ops = n;
+		pad->hoist_x = hx;
+		pad->hoist_y = hy;
+		size_t size = CARVE(slots, sizeof(fp_type) * BLOCK_SIZE) + CARVE(n, sizeof(interval))
+			+ CARVE(n, sizeof(fp_type) * BLOCK_SIZE) + CARVE(slots, sizeof(float) * BLOCK_SIZE)
+			+ CARVE(n, sizeof(float) * BLOCK_SIZE) + (2 * CARVE(n, 1)) + (5 * CARVE(n, sizeof(int)))
+			+ CARVE(HOIST_COLUMNS * hx, sizeof(interval)) + CARVE(HOIST_COLUMNS * hx, 1) + CARVE(HOIST_COLUMNS, sizeof(interval))
+			+ CARVE(HOIST_COLUMNS, 1) + CARVE(hy, sizeof(interval)) + CARVE(hy, 1);
+		char *p = (char *) arena_alloc(size, &pad->arena_size);
+		pad->arena = p;
+		pad->scratch = (fp_type *) p;
+		p += CARVE(slots, sizeof(fp_type) * BLOCK_SIZE);
+		// Simplified tapes give every operation a slot of its own, so intervals need n.
+		pad->iscratch = (interval *) p;
+		p += CARVE(n, sizeof(interval));
+		pad->tscratch = (fp_type *) p;
+		p += CARVE(n, sizeof(fp_type) * BLOCK_SIZE);
+		pad->fscratch = (float *) p;
+		p += CARVE(slots, sizeof(float) * BLOCK_SIZE);
+		pad->ftscratch = (float *) p;
+		p += CARVE(n, sizeof(float) * BLOCK_SIZE);
+		pad->columns = (interval *) p;
+		p += CARVE(HOIST_COLUMNS * hx, sizeof(interval));
+		pad->column_choices = p;
+		p += CARVE(HOIST_COLUMNS * hx, 1);
+		pad->column_keys = (interval *) p;
+		p += CARVE(HOIST_COLUMNS, sizeof(interval));
+		pad->column_nan = p;
+		p += CARVE(HOIST_COLUMNS, 1);
+		pad->row = (interval *) p;
+		p += CARVE(hy, sizeof(interval));
+		pad->row_choices = p;
+		p += CARVE(hy, 1);
+		pad->choices = p;
+		p += CARVE(n, 1);
+		pad->live = p;
+		p += CARVE(n, 1);
+		pad->producer = (int *) p;
+		p += CARVE(n, sizeof(int));
+		pad->alias = (int *) p;
+		p += CARVE(n, sizeof(int));
+		pad->srca = (int *) p;
+		p += CARVE(n, sizeof(int));
+		pad->srcb = (int *) p;
+		p += CARVE(n, sizeof(int));
+		pad->slot = (int *) p;
+	}
+	// A new job could have a new tape where the old one was.
+	pad->hoisted = (func *)0;
+	pad->precision = precision;
+	return 0;
+}
+
+
+void scratchpad_free(scratchpad *pad) {
+	arena_free(pad->arena, pad->arena_size);
+	profile *prof = pad->prof;
+	scratchpad_init(pad);
+	pad->prof = prof;
+}
+
+
+/* Render the w by h chunk of the image with its top left corner at pixel x, y into data, 
+ * which points at that corner. xspace and yspace hold the coordinates of every column 
+ * and row of the image. */
+int render_chunk(func *sdf, scratchpad *pad, int x, int y, int w, int h, char *data, int stride, const fp_type *xspace, const fp_type *yspace) {
+	if (INTERVAL_CULL) return render_tile(sdf, pad, x, y, w, h, data, stride, xspace, yspace);
+	return render_rect(sdf, pad, 0, x, y, w, h, data, stride, xspace, yspace);
+}
+
+
+/* Evaluate the function at n <= BLOCK_SIZE points, x and y coordinates in xs and ys, 
+ * into out. Goes to the JIT if the function has been compiled and the precision is 
+ * double, which is all the JIT does, otherwise render_block. The rest of xs and ys 
+ * are filled in by repeating the last point, so they have to be BLOCK_SIZE long. 
+ * short_tape says to use the scratch set aside for the short functions from simplify.
+ *
+ * In float precision, render_block_float does the work instead. In mixed precision, 
+ * anything the float pass puts within MIXED_BOUND of zero gets a second opinion from 
+ * render_block, since that's where float's rounding could flip the sign. */
+int render_batch(func *sdf, scratchpad *pad, int short_tape, int n, fp_type *xs, fp_type *ys, fp_type *out) {
+	fp_type again[BLOCK_SIZE];
+	float fxs[BLOCK_SIZE], fys[BLOCK_SIZE], fout[BLOCK_SIZE];
+	int redo[BLOCK_SIZE];
+	int m, j;
+	fp_type *scratch = short_tape ? pad->tscratch : pad->scratch;
+	float *fscratch = short_tape ? pad->ftscratch : pad->fscratch;
+
+	for (j = n; j < BLOCK_SIZE; j++) {
+		xs[j] = xs[n - 1];
+		ys[j] = ys[n - 1];
+	}
+	if (PROFILE && pad->prof) profile_tape(pad->prof, sdf, n);
+	if (sdf->jit && (pad->precision == PRECISION_DOUBLE)) {
+		for (j = 0; j < n; j += sdf->jit->width) {
+			sdf->jit->fn(xs + j, ys + j, out + j);
+		}
+	} else if (pad->precision == PRECISION_DOUBLE) {
+		render_block(sdf, scratch, xs, ys, out);
+	} else {
+		for (j = 0; j < BLOCK_SIZE; j++) {
+			fxs[j] = xs[j];
+			fys[j] = ys[j];
+		}
+		render_block_float(sdf, fscratch, fxs, fys, fout);
+		m = 0;
+		for (j = 0; j < n; j++) {
+			out[j] = fout[j];
+			if ((pad->precision == PRECISION_MIXED) && (fout[j] > -MIXED_BOUND) && (fout[j] < MIXED_BOUND)) {
+				redo[m] = j;
+				xs[m] = xs[j];
+				ys[m] = ys[j];
+				m++;
+			}
+		}
+		if (m) {
+			for (j = m; j < BLOCK_SIZE; j++) {
+				xs[j] = xs[m - 1];
+				ys[j] = ys[m - 1];
+			}
+			render_block(sdf, scratch, xs, ys, again);
+			for (j = 0; j < m; j++) out[redo[j]] = again[j];
+		}
+	}
+	return 0;
+}
+
+
+/* Render every pixel in a w by h rectangle with its top left corner at pixel x, y, 
+ * into data, which points at that corner. Pixels are gathered a row at a time into 
+ * batches of BLOCK_SIZE for render_batch. */
+int render_rect(func *sdf, scratchpad *pad, int short_tape, int x, int y, int w, int h, char *data, int stride, const fp_type *xspace, const fp_type *yspace) {
+	fp_type xs[BLOCK_SIZE], ys[BLOCK_SIZE], out[BLOCK_SIZE];
+	int index[BLOCK_SIZE];
+	int n = 0, j;
+
+	for (int row = y; row < y + h; row++) {
+		for (int col = x; col < x + w; col++) {
+			xs[n] = xspace[col];
+			ys[n] = yspace[row];
+			index[n] = ((row - y) * stride) + (col - x);
+			n++;
+			if ((n < BLOCK_SIZE) && !((row == y + h - 1) && (col == x + w - 1))) continue;
+
+			render_batch(sdf, pad, short_tape, n, xs, ys, out);
+			for (j = 0; j < n; j++) {
+				data[index[j]] = (out[j] < 0) ? 255 : 0;
+			}
+			n = 0;
+		}
+	}
+	return 0;
+}
+
+
+/* Render a w by h tile with its top left corner at pixel x, y, into data, which points 
+ * at that corner.
+ *
+ * The whole tile is evaluated at once over intervals. If the function is negative (or 
+ * not negative) everywhere in the tile, it gets filled without looking at a single pixel. 
+ * Otherwise the tile is cut into quarters and we try again, until the pieces are small 
+ * enough that it is cheaper to just render the pixels. Only tiles on the edge of the 
+ * shape ever get that far, so the work grows with the length of the edge, not the area. 
+ *
+ * With SIMPLIFY_TAPE, every ambiguous tile also gets its own copy of the function with 
+ * the branches that can't matter inside it cut out, and everything inside the tile runs 
+ * the shorter copy. */
+int render_tile(func *sdf, scratchpad *pad, int x, int y, int w, int h, char *data, int stride, const fp_type *xspace, const fp_type *yspace) {
+	interval ix, iy, result;
+	func tape;
+
+	// Pixel rows run top down, but y runs bottom up.
+	ix.lo = xspace[x];
+	ix.hi = xspace[x + w - 1];
+	iy.lo = yspace[y + h - 1];
+	iy.hi = yspace[y];
+
+	if (HOIST_SEPARABLE && SIMPLIFY_TAPE && sdf->sorted) {
+		// A whole tile of the whole function. From here down it's the sorted copy.
+		sdf = sdf->sorted;
+		result = hoisted_interval(sdf, pad, x / TILE_SIZE, ix, iy);
+	} else {
+		result = render_interval(sdf, pad->iscratch, pad->choices, ix, iy);
+	}
+	if (PROFILE && pad->prof) pad->prof->intervals++;
+	if (result.hi < 0) return fill_tile(data, stride, w, h, 255);
+	if (result.lo >= 0) return fill_tile(data, stride, w, h, 0);
+
+	// Ambiguous (or NaN), look closer.
+	if (SIMPLIFY_TAPE) {
+		simplify(sdf, pad, 0, &tape);
+	} else {
+		tape = *sdf;
+	}
+
+	if ((w <= MIN_TILE) || (h <= MIN_TILE)) {
+		render_rect(&tape, pad, SIMPLIFY_TAPE, x, y, w, h, data, stride, xspace, yspace);
+	} else {
+		int w2 = w / 2;
+		int h2 = h / 2;
+		char *lower = data + (h2 * stride);
+		render_tile(&tape, pad, x,      y,      w2,     h2,     data,       stride, xspace, yspace);
+		render_tile(&tape, pad, x + w2, y,      w - w2, h2,     data + w2,  stride, xspace, yspace);
+		render_tile(&tape, pad, x,      y + h2, w2,     h - h2, lower,      stride, xspace, yspace);
+		render_tile(&tape, pad, x + w2, y + h2, w - w2, h - h2, lower + w2, stride, xspace, yspace);
 	}
-	printf("\n");
 
-	int data_size = sizeof(char) * IMAGE_SIZE * IMAGE_SIZE;
+	if (SIMPLIFY_TAPE) free(tape.func);
+	return 0;
+}
 
-	char * data = (char *) malloc(data_size);
-	if (!data) {
-		fprintf(stderr, "Memory allocation failed.\n");
-		exit(1);
+
+/* render_tile for only the pixels marked NEED_PIXEL in mask, which is laid out like 
+ * data. The rest are left alone, unless the intervals settle a square with some of 
+ * them in it, then all of it is filled in and marked KNOWN_PIXEL. Once the pixels 
+ * left to do fit in one block there's no point cutting the tile up any more, the 
+ * intervals would cost more than they save. */
+int render_masked(func *sdf, scratchpad *pad, int x, int y, int w, int h, char *mask, char *data, int stride, const fp_type *xspace, const fp_type *yspace) {
+	fp_type xs[BLOCK_SIZE], ys[BLOCK_SIZE], out[BLOCK_SIZE];
+	int index[BLOCK_SIZE];
+	interval ix, iy, result;
+	func tape = *sdf;
+	int row, col, j, n = 0, count = 0;
+
+	for (row = 0; row < h; row++) {
+		for (col = 0; col < w; col++) count += (mask[(row * stride) + col] == NEED_PIXEL);
 	}
-	
-	int num_threads = NUM_THREADS;
-	printf("Starting render... ");
-	if (num_threads) printf("spawning %d threads. ", num_threads);
-	printf("\n");
+	if (!count) return 0;
 
-	START_TIMER
-	if (num_threads) {
-		pthread_t threads[num_threads];
-		chunk_args args[num_threads];
-		int chunk_size = (data_size / num_threads);  
-		int i = 0;
-
-		for (i=0; i < (num_threads - 1); i++) { 
-			args[i].sdf = &sdf;
-			args[i].startidx = chunk_size * i;
-			args[i].size = chunk_size;
-			args[i].stride = IMAGE_SIZE;
-			args[i].data = data;
-			args[i].space = space;
-			if (pthread_create(&threads[i], NULL, start_thread, &args[i])) {
-				fprintf(stderr, "Problem creating thread\n");
-				exit(1);
+	if (INTERVAL_CULL) {
+		ix.lo = xspace[x];
+		ix.hi = xspace[x + w - 1];
+		iy.lo = yspace[y + h - 1];
+		iy.hi = yspace[y];
+		result = render_interval(sdf, pad->iscratch, pad->choices, ix, iy);
+		if (PROFILE && pad->prof) pad->prof->intervals++;
+		if ((result.hi < 0) || (result.lo >= 0)) {
+			// Settled for the whole square, not just the pixels we were asked for.
+			for (row = 0; row < h; row++) {
+				memset(data + ((long) row * stride), (result.hi < 0) ? 255 : 0, w);
+				memset(mask + ((long) row * stride), KNOWN_PIXEL, w);
 			}
+			return 0;
 		}
-		args[i].sdf = &sdf;
-		args[i].startidx = (num_threads - 1) * chunk_size;
-		args[i].size = data_size - args[i].startidx;
-		args[i].stride = IMAGE_SIZE;
-		args[i].data = data;
-		args[i].space = space;
-		if (pthread_create(&threads[i], NULL, start_thread, &args[i])) {
-			fprintf(stderr, "Problem creating last thread\n");
-			exit(1);
+		if (SIMPLIFY_TAPE) simplify(sdf, pad, 0, &tape);
+		if ((count > BLOCK_SIZE) && (w > MIN_TILE) && (h > MIN_TILE)) {
+			int w2 = w / 2;
+			int h2 = h / 2;
+			long lower = (long) h2 * stride;
+			render_masked(&tape, pad, x,      y,      w2,     h2,     mask,              data,              stride, xspace, yspace);
+			render_masked(&tape, pad, x + w2, y,      w - w2, h2,     mask + w2,         data + w2,         stride, xspace, yspace);
+			render_masked(&tape, pad, x,      y + h2, w2,     h - h2, mask + lower,      data + lower,      stride, xspace, yspace);
+			render_masked(&tape, pad, x + w2, y + h2, w - w2, h - h2, mask + lower + w2, data + lower + w2, stride, xspace, yspace);
+			if (SIMPLIFY_TAPE) free(tape.func);
+			return 0;
 		}
+	}
 
-		// Wait
-		for (i=0; i < num_threads; i++) {
-			if (pthread_join(threads[i], NULL)) {
-				fprintf(stderr, "Problem joining threads\n");
-				exit(1);
-			}
+	for (row = 0; row < h; row++) {
+		for (col = 0; col < w; col++) {
+			if (mask[(row * stride) + col] != NEED_PIXEL) continue;
+			xs[n] = xspace[x + col];
+			ys[n] = yspace[y + row];
+			index[n] = (row * stride) + col;
+			if (++n < BLOCK_SIZE) continue;
+			render_batch(&tape, pad, INTERVAL_CULL && SIMPLIFY_TAPE, n, xs, ys, out);
+			for (j = 0; j < n; j++) data[index[j]] = (out[j] < 0) ? 255 : 0;
+			n = 0;
 		}
-
-	} else {
-		render_chunk(&sdf, 0, data_size, IMAGE_SIZE, data, space);
 	}
-	PRINT_TIMER
-	printf("\n ");
-
-	write_ppm(OUTFILE, data, data_size);
-
-	free(data);
-	free(space);
-	free(sdf.func);
-	free(sdf.constfree);
+	if (n) {
+		render_batch(&tape, pad, INTERVAL_CULL && SIMPLIFY_TAPE, n, xs, ys, out);
+		for (j = 0; j < n; j++) data[index[j]] = (out[j] < 0) ? 255 : 0;
+	}
+	if (INTERVAL_CULL && SIMPLIFY_TAPE) free(tape.func);
 	return 0;
 }
 
 
-/* Opens filename and parses instructions out of it.
+/* Make a shorter copy of the function, for use inside the region the last call to 
+ * render_interval looked at.
  *
- * Returns a func structure containing an array of operations and its length.
- * Caller must free the operation array inside the func. 
+ * Wherever a MIN or MAX always picked the same operand, the operation is dropped and 
+ * anything that used its result reads the winner directly. The loser, and anything 
+ * else nobody reads anymore, is dropped too. What's left is renumbered so it only 
+ * needs as many slots of scratch as it has instructions.
  *
- * Warning: an attacker able to provide arbitrary input to this function may be able
- * to craft an input string that causes this function to hack your Amazon account 
- * and express order the entire Herb Schildt reference library. */
-func parse_file(const char* filename) {
-	func ret;
-	ret.size = 0;
-	ret.constfree = (operation *)0;
-	ret.constfreesize = 0;
-	int linecount = 0;
-	int c, ok;
-	char line[255];
-	operation * oper;
-	FILE* input = fopen(filename, "r");
-	if (!input) {
-		fprintf(stderr, "File opening failed\n");
+ * If separate is set, the survivors also get sorted by what they depend on: first 
+ * everything that needs x or nothing at all, then everything that needs y, then 
+ * everything that needs both, with out->xops and out->yops saying where the first two 
+ * end, for hoisted_interval. Nothing can read anything from a later group, so it's 
+ * still in order.
+ *
+ * Slots may have been reused by allocate_registers, so everything here is tracked by 
+ * the position of the operation in the function rather than the slot it writes.
+ * Caller must free out->func. */
+int simplify(func *sdf, scratchpad *pad, int separate, func *out) {
+	operation *oper;
+	int *producer = pad->producer;
+	int *alias = pad->alias;
+	int *srca = pad->srca;
+	int *srcb = pad->srcb;
+	int *slot = pad->slot;
+	char *live = pad->live;
+	char *choices = pad->choices;
+	int i, count = 0;
+	int group[3] = {0, 0, 0};
+
+	// Follow each operand to the operation that really computes it.
+	for (i = 0; i < sdf->size; i++) {
+		oper = sdf->func + i;
+		live[i] = 0;
+		switch (oper->code) {
+			case VAR_X:
+			case VAR_Y:
+			case CONST:
+				break;
+			case NEG:
+			case SQUARE:
+			case SQRT:
+			case ADD_IMM:
+			case SUB_IMM:
+			case IMM_SUB:
+			case MUL_IMM:
+			case MAX_IMM:
+			case MIN_IMM:
+				srca[i] = alias[producer[oper->a]];
+				break;
+			case ADD:
+			case SUB:
+			case MUL:
+			case MAX:
+			case MIN:
+			case HYPOT:
+			case MAX_NEG:
+			case MIN_NEG:
+				srca[i] = alias[producer[oper->a]];
+				srcb[i] = alias[producer[oper->b]];
+				break;
+		}
+		// MAX_NEG and MIN_NEG that go with b are still a NEG, not a copy, and the _IMM 
+		// ones turn into a CONST.
+		if (choices[i] == CHOICE_A) {
+			alias[i] = srca[i];
+		} else if ((choices[i] == CHOICE_B) && ((oper->code == MAX) || (oper->code == MIN))) {
+			alias[i] = srcb[i];
+		} else {
+			alias[i] = i;
+		}
+		producer[oper->line] = i;
+	}
+
+	// Work back from the output to find out what it depends on.
+	live[alias[sdf->size - 1]] = 1;
+	for (i = sdf->size - 1; i >= 0; i--) {
+		oper = sdf->func + i;
+		if (!live[i]) continue;
+		count++;
+		switch (oper->code) {
+			case VAR_X:
+			case VAR_Y:
+			case CONST:
+				break;
+			case NEG:
+			case SQUARE:
+			case SQRT:
+			case ADD_IMM:
+			case SUB_IMM:
+			case IMM_SUB:
+			case MUL_IMM:
+				live[srca[i]] = 1;
+				break;
+			case MAX_IMM:
+			case MIN_IMM:
+				if (choices[i] != CHOICE_B) live[srca[i]] = 1;
+				break;
+			case ADD:
+			case SUB:
+			case MUL:
+			case MAX:
+			case MIN:
+			case HYPOT:
+				live[srca[i]] = 1;
+				live[srcb[i]] = 1;
+				break;
+			case MAX_NEG:
+			case MIN_NEG:
+				if (choices[i] != CHOICE_B) live[srca[i]] = 1;
+				live[srcb[i]] = 1;
+				break;
+		}
+	}
+
+	// live becomes 1 plus the DEPENDS_ bits of each survivor, and group counts them by 
+	// where they go. If they're not being sorted they all stay 1, and in group 0.
+	if (separate) {
+		for (i = 0; i < sdf->size; i++) {
+			oper = sdf->func + i;
+			if (!live[i]) continue;
+			switch (oper->code) {
+				case VAR_X:
+					live[i] = 1 + DEPENDS_X;
+					break;
+				case VAR_Y:
+					live[i] = 1 + DEPENDS_Y;
+					break;
+				case CONST:
+					break;
+				case NEG:
+				case SQUARE:
+				case SQRT:
+				case ADD_IMM:
+				case SUB_IMM:
+				case IMM_SUB:
+				case MUL_IMM:
+					live[i] = live[srca[i]];
+					break;
+				case MAX_IMM:
+				case MIN_IMM:
+					if (choices[i] != CHOICE_B) live[i] = live[srca[i]];
+					break;
+				case ADD:
+				case SUB:
+				case MUL:
+				case MAX:
+				case MIN:
+				case HYPOT:
+					live[i] = 1 + ((live[srca[i]] - 1) | (live[srcb[i]] - 1));
+					break;
+				case MAX_NEG:
+				case MIN_NEG:
+					if (choices[i] == CHOICE_B) {
+						live[i] = live[srcb[i]];
+						break;
+					}
+					live[i] = 1 + ((live[srca[i]] - 1) | (live[srcb[i]] - 1));
+					break;
+			}
+			group[HOIST_GROUP(live[i])]++;
+		}
+	} else {
+		group[0] = count;
+	}
+
+	out->func = (operation *) malloc(sizeof(operation) * count);
+	if (!out->func) {
+		fprintf(stderr, "Memory allocation failed.\n");
 		exit(1);
 	}
-	while ((c = fgetc(input)) != EOF) {
-		if (c == '\n') linecount++;
+	out->size = count;
+	out->slots = count;
+	out->xops = separate ? group[0] : 0;
+	out->yops = group[1];
+	out->sorted = (func *)0;
+	out->mapping = (void *)0;
+	out->jit = (jit_code *)0;
+	// Each copy is only run for a block or so of pixels, which doesn't pay for packing it.
+	out->packed = (packed_op *)0;
+	out->pool = (fp_type *)0;
+
+	// Copy out the survivors, each group after the one before. The output of the 
+	// function is always the last one: everything else feeds it, so if it doesn't need 
+	// both x and y, nothing does.
+	operation *next[3] = {out->func, out->func + group[0], out->func + group[0] + group[1]};
+	operation *output;
+	for (i = 0; i < sdf->size; i++) {
+		oper = sdf->func + i;
+		if (!live[i]) continue;
+		output = next[HOIST_GROUP(live[i])]++;
+		memcpy(output, oper, sizeof(operation));
+		slot[i] = output - out->func;
+		output->line = slot[i];
+		switch (oper->code) {
+			case VAR_X:
+			case VAR_Y:
+			case CONST:
+				break;
+			case NEG:
+			case SQUARE:
+			case SQRT:
+			case ADD_IMM:
+			case SUB_IMM:
+			case IMM_SUB:
+			case MUL_IMM:
+				output->a = slot[srca[i]];
+				break;
+			case MAX_IMM:
+			case MIN_IMM:
+				if (choices[i] == CHOICE_B) {
+					output->code = CONST;
+					break;
+				}
+				output->a = slot[srca[i]];
+				break;
+			case ADD:
+			case SUB:
+			case MUL:
+			case MAX:
+			case MIN:
+			case HYPOT:
+				output->a = slot[srca[i]];
+				output->b = slot[srcb[i]];
+				break;
+			case MAX_NEG:
+			case MIN_NEG:
+				if (choices[i] == CHOICE_B) {
+					output->code = NEG;
+					output->a = slot[srcb[i]];
+					break;
+				}
+				output->a = slot[srca[i]];
+				output->b = slot[srcb[i]];
+				break;
+		}
 	}
-	printf("Parsing file: %s, file linecount: %d, ", filename, linecount);
+	return sdf->size - count;
+}
 
-	fseek(input, 0, SEEK_SET);
 
-	ret.func = (operation *) malloc(sizeof(operation) * (linecount + 1));
-	if (!ret.func) {
+/* Hang a copy of sdf off sdf->sorted, sorted by simplify with nothing cut out, for 
+ * render_tile to start every tile from with hoisted_interval, if there's enough in it 
+ * that only needs x or y. Nothing to do without HOIST_SEPARABLE, or the intervals and 
+ * simplify it's for. */
+void separate_func(func *sdf) {
+	scratchpad pad;
+	sdf->sorted = (func *)0;
+	if (!(HOIST_SEPARABLE && INTERVAL_CULL && SIMPLIFY_TAPE)) return;
+
+	func *sorted = (func *) malloc(sizeof(func));
+	if (!sorted) {
 		fprintf(stderr, "Memory allocation failed.\n");
 		exit(1);
 	}
-	oper = ret.func;
-
-	while (EOF != (fscanf(input, "%254[^\n]\n", line))) {
-		ok = parse_line(line, oper);
-		if (ok) {
-			ret.size += ok;
-			oper += ok;
-		}
-	}
-
-	printf("instruction count: %d, ", ret.size);
-	return ret;
-}
-
-
-/* Parse one instruction in a C string, and store the operation in op 
- * Returns the number of instructions processed. */
-int parse_line(const char* line, operation* op) {
-	if ((line[0] == '#') | (line[0] =='\n')) return 0;
-	
-	int ok, lno, a, b;
-	char opname[8], args[16];
-	fp_type cval;
-
-	ok = sscanf(line, "_%x %s %15[^\n]\n", &lno, opname, args);
-	if ((ok != 3)&&(ok != 2)) goto error;
-
-	if (strcmp(opname, "var-x")==0) {
-		op->code = VAR_X;
-		op->line = lno;
-		return 1;
-	}
-	if (strcmp(opname, "var-y")==0) {
-		op->code = VAR_Y;
-		op->line = lno;
-		return 1;
-	}
-	if (strcmp(opname, "const")==0) {
-		op->code = CONST;
-		op->line = lno;
-		cval = strto_fp(args, NULL);  
-		op->value = cval;
-		return 1;
-	}
-	if (strcmp(opname, "square")==0) {
-		op->code = SQUARE;
-		op->line = lno;
-		ok = sscanf(args, "_%x", &a);
-		if (ok != 1) goto error;
-		op->a = a;
-		return 1;
-	}
-	if (strcmp(opname, "sqrt")==0) {
-		op->code = SQRT;
-		op->line = lno;
-		ok = sscanf(args, "_%x", &a);
-		if (ok != 1) goto error;
-		op->a = a;
-		return 1;
-	}
-	if (strcmp(opname, "neg")==0) {
-		op->code = NEG;
-		op->line = lno;
-		ok = sscanf(args, "_%x", &a);
-		if (ok != 1) goto error;
-		op->a = a;
-		return 1;
-	}
-	if (strcmp(opname, "add")==0) {
-		op->code = ADD;
-		op->line = lno;
-		ok = sscanf(args, "_%x _%x", &a, &b);
-		if (ok != 2) goto error;
-		op->a = a;
-		op->b = b;
-		return 1;
-	}
-	if (strcmp(opname, "sub")==0) {
-		op->code = SUB;
-		op->line = lno;
-		ok = sscanf(args, "_%x _%x", &a, &b);
-		if (ok != 2) goto error;
-		op->a = a;
-		op->b = b;
-		return 1;
-	}
-	if (strcmp(opname, "mul")==0) {
-		op->code = MUL;
-		op->line = lno;
-		ok = sscanf(args, "_%x _%x", &a, &b);
-		if (ok != 2) goto error;
-		op->a = a;
-		op->b = b;
-		return 1;
-	}
-	if (strcmp(opname, "max")==0) {
-		op->code = MAX;
-		op->line = lno;
-		ok = sscanf(args, "_%x _%x", &a, &b);
-		if (ok != 2) goto error;
-		op->a = a;
-		op->b = b;
-		return 1;
-	}
-	if (strcmp(opname, "min")==0) {
-		op->code = MIN;
-		op->line = lno;
-		ok = sscanf(args, "_%x _%x", &a, &b);
-		if (ok != 2) goto error;
-		op->a = a;
-		op->b = b;
-		return 1;
-	}
-
-error:
-	fprintf(stderr, "Unable to parse line: %s\n", line);
+	scratchpad_init(&pad);
+	scratchpad_reserve(&pad, sdf, PRECISION_DOUBLE);
+	memset(pad.choices, CHOICE_BOTH, sdf->size);
+	simplify(sdf, &pad, 1, sorted);
+	scratchpad_free(&pad);
+	// Not much to hoist isn't worth the sorted copy's bigger scratch.
+	if ((sorted->xops + sorted->yops) * HOIST_SHARE < sorted->size) {
+		free(sorted->func);
+		free(sorted);
+		return;
+	}
+	sdf->sorted = sorted;
+}
+
+
+/* Set every pixel in a w by h tile to value. data points at the top left corner. */
+int fill_tile(char *data, int stride, int w, int h, char value) {
+	for (int row = 0; row < h; row++) {
+		memset(data + (row * stride), value, w);
+	}
 	return 0;
 }
 
 
-void *start_thread(void * args_in) {
-	chunk_args * args = (chunk_args *)args_in;
-	render_chunk(args->sdf, args->startidx, args->size, args->stride, args->data, args->space);
-	return (void *)0;
+/* The square of every number in a. */
+interval interval_square(interval a) {
+	interval r;
+	if (a.lo >= 0) {
+		r.lo = a.lo * a.lo;
+		r.hi = a.hi * a.hi;
+	} else if (a.hi <= 0) {
+		r.lo = a.hi * a.hi;
+		r.hi = a.lo * a.lo;
+	} else {
+		// Straddles zero, so zero is the least it can be.
+		r.lo = 0;
+		r.hi = fmax_fp(a.lo * a.lo, a.hi * a.hi);
+	}
+	return r;
 }
 
 
-int render_chunk(func *sdf, int startidx, int size, int stride, char *data, fp_type *space) {
+/* The instructions of sdf from first up to but not including last, for render_interval. 
+ * choices is indexed by position in all of sdf. Returns 1 if any of them might have 
+ * made a NaN. */
+static int interval_ops(func *sdf, int first, int last, interval *memory, char *choices, interval x, interval y) {
+	operation* function = sdf->func;
+	interval a, b, r;
+	fp_type p1, p2, p3, p4;
+	int maybe_nan = 0;
 
-	quadresult fourpix;
-	fp_type * scratch4;
-	fp_type * scratch;
-	scratch4 = (fp_type *) malloc(sizeof(fp_type) * sdf->size * 4 + (5 * sizeof(fp_type)));
-	scratch = (fp_type *) malloc(sizeof(fp_type) * sdf->size + (2 * sizeof(fp_type)));
-	if (!(scratch && scratch4)) {
-		fprintf(stderr, "Memory allocation failed.\n");
-		exit(1);
+	for (int i = first; i < last; i++) {
+		function = sdf->func + i;
+		switch (function->code) {
+			case VAR_X:
+				r = x;
+				break;
+			case VAR_Y:
+				r = y;
+				break;
+			case CONST:
+				r.lo = function->value;
+				r.hi = function->value;
+				break;
+			case NEG:
+				a = memory[function->a];
+				r.lo = -a.hi;
+				r.hi = -a.lo;
+				break;
+			case SQUARE:
+				r = interval_square(memory[function->a]);
+				break;
+			case SQRT:
+				a = memory[function->a];
+				if (a.lo >= 0) {
+					r.lo = sqrt_fp(a.lo);
+					r.hi = sqrt_fp(a.hi);
+					break;
+				}
+				maybe_nan = 1;
+				if (a.hi >= 0) {
+					// Only the non-negative part of the input has an answer.
+					r.lo = 0;
+					r.hi = sqrt_fp(a.hi);
+				} else {
+					// Nothing but NaN in here, which makes everything downstream ambiguous. 
+					r.lo = sqrt_fp(a.lo);
+					r.hi = r.lo;
+				}
+				break;
+			case ADD:
+				a = memory[function->a];
+				b = memory[function->b];
+				r.lo = a.lo + b.lo;
+				r.hi = a.hi + b.hi;
+				break;
+			case SUB:
+				a = memory[function->a];
+				b = memory[function->b];
+				r.lo = a.lo - b.hi;
+				r.hi = a.hi - b.lo;
+				break;
+			case MUL:
+				a = memory[function->a];
+				b = memory[function->b];
+				p1 = a.lo * b.lo;
+				p2 = a.lo * b.hi;
+				p3 = a.hi * b.lo;
+				p4 = a.hi * b.hi;
+				r.lo = fmin_fp(fmin_fp(p1, p2), fmin_fp(p3, p4));
+				r.hi = fmax_fp(fmax_fp(p1, p2), fmax_fp(p3, p4));
+				break;
+			case MAX:
+				a = memory[function->a];
+				b = memory[function->b];
+				r.lo = fmax_fp(a.lo, b.lo);
+				r.hi = fmax_fp(a.hi, b.hi);
+				if (choices) {
+					if (a.lo > b.hi) choices[i] = CHOICE_A;
+					else if (b.lo > a.hi) choices[i] = CHOICE_B;
+					else choices[i] = CHOICE_BOTH;
+				}
+				memory[function->line] = r;
+				continue;
+			case MIN:
+				a = memory[function->a];
+				b = memory[function->b];
+				r.lo = fmin_fp(a.lo, b.lo);
+				r.hi = fmin_fp(a.hi, b.hi);
+				if (choices) {
+					if (a.hi < b.lo) choices[i] = CHOICE_A;
+					else if (b.hi < a.lo) choices[i] = CHOICE_B;
+					else choices[i] = CHOICE_BOTH;
+				}
+				memory[function->line] = r;
+				continue;
+			case HYPOT:
+				a = interval_square(memory[function->a]);
+				b = interval_square(memory[function->b]);
+				r.lo = sqrt_fp(a.lo + b.lo);
+				r.hi = sqrt_fp(a.hi + b.hi);
+				break;
+			case MAX_NEG:
+				a = memory[function->a];
+				p1 = memory[function->b].lo;
+				b.lo = -memory[function->b].hi;
+				b.hi = -p1;
+				r.lo = fmax_fp(a.lo, b.lo);
+				r.hi = fmax_fp(a.hi, b.hi);
+				if (choices) {
+					if (a.lo > b.hi) choices[i] = CHOICE_A;
+					else if (b.lo > a.hi) choices[i] = CHOICE_B;
+					else choices[i] = CHOICE_BOTH;
+				}
+				memory[function->line] = r;
+				continue;
+			case MIN_NEG:
+				a = memory[function->a];
+				p1 = memory[function->b].lo;
+				b.lo = -memory[function->b].hi;
+				b.hi = -p1;
+				r.lo = fmin_fp(a.lo, b.lo);
+				r.hi = fmin_fp(a.hi, b.hi);
+				if (choices) {
+					if (a.hi < b.lo) choices[i] = CHOICE_A;
+					else if (b.hi < a.lo) choices[i] = CHOICE_B;
+					else choices[i] = CHOICE_BOTH;
+				}
+				memory[function->line] = r;
+				continue;
+			case ADD_IMM:
+				a = memory[function->a];
+				r.lo = a.lo + function->value;
+				r.hi = a.hi + function->value;
+				break;
+			case SUB_IMM:
+				a = memory[function->a];
+				r.lo = a.lo - function->value;
+				r.hi = a.hi - function->value;
+				break;
+			case IMM_SUB:
+				a = memory[function->a];
+				r.lo = function->value - a.hi;
+				r.hi = function->value - a.lo;
+				break;
+			case MUL_IMM:
+				a = memory[function->a];
+				p1 = a.lo * function->value;
+				p2 = a.hi * function->value;
+				r.lo = fmin_fp(p1, p2);
+				r.hi = fmax_fp(p1, p2);
+				break;
+			case MAX_IMM:
+				a = memory[function->a];
+				r.lo = fmax_fp(a.lo, function->value);
+				r.hi = fmax_fp(a.hi, function->value);
+				if (choices) {
+					if (a.lo > function->value) choices[i] = CHOICE_A;
+					else if (function->value > a.hi) choices[i] = CHOICE_B;
+					else choices[i] = CHOICE_BOTH;
+				}
+				memory[function->line] = r;
+				continue;
+			case MIN_IMM:
+				a = memory[function->a];
+				r.lo = fmin_fp(a.lo, function->value);
+				r.hi = fmin_fp(a.hi, function->value);
+				if (choices) {
+					if (a.hi < function->value) choices[i] = CHOICE_A;
+					else if (function->value < a.lo) choices[i] = CHOICE_B;
+					else choices[i] = CHOICE_BOTH;
+				}
+				memory[function->line] = r;
+				continue;
+		}
+		if (choices) choices[i] = CHOICE_BOTH;
+		memory[function->line] = r;
 	}
-	scratch4[sdf->size * 4 + 4] = 0.0; // Be sure the sentinel value for cut const is not set.
-	scratch[sdf->size + 1] = 0.0;
+	return maybe_nan;
+}
 
-	int xstart = startidx / stride;
-	int xfin = xstart + (size / stride);
-	for (int x=xstart; x <= xfin; x++) {
-		int y;
-		for (y=0; y + 4 <= stride; y += 4) {
-			render_four_pixels(sdf, scratch4, space[x], -space[y], -space[y+1], -space[y+2], -space[y+3], &fourpix);
-			data[(y+0)*stride+(x)] = (fourpix.one   < 0) ? 255 : 0;
-			data[(y+1)*stride+(x)] = (fourpix.two   < 0) ? 255 : 0;
-			data[(y+2)*stride+(x)] = (fourpix.three < 0) ? 255 : 0;
-			data[(y+3)*stride+(x)] = (fourpix.four  < 0) ? 255 : 0;
-		}
-		for (; y < stride; y++) {
-			data[y*stride+x] = (render_pixel(sdf, scratch, space[x], -space[y]) < 0) ? 255 : 0;
-		}
+
+/* Evaluate the function over a whole rectangle at once.
+ *
+ * Every value is an interval guaranteed to contain every result the function could 
+ * produce for x and y within the input intervals. The bounds can be loose, but never 
+ * wrong (give or take rounding in the last place). memory is indexed like the scratch 
+ * for render_block, one interval per slot.
+ *
+ * If choices isn't null, it gets one entry per operation saying which operand of each 
+ * MIN and MAX won over the whole region, for simplify to work from.
+ *
+ * The one thing an interval can't hold is NaN, from the square root of a negative 
+ * number. A NaN pixel is outside, so if there might be any, the result is never 
+ * allowed to say the whole region is inside. */
+interval render_interval(func *sdf, interval *memory, char *choices, interval x, interval y) {
+	int maybe_nan = interval_ops(sdf, 0, sdf->size, memory, choices, x, y);
+	interval r = memory[sdf->func[sdf->size - 1].line];
+	if (maybe_nan && (r.hi < 0)) r.hi = 0;
+	return r;
+}
+
+
+/* render_interval for the first look at a tile of a function from separate_func, with 
+ * memory and choices from pad, keeping what won't change for the next tile. The first 
+ * sdf->xops instructions only need x, so what they came to is kept for each of 
+ * HOIST_COLUMNS columns of tiles, and the next sdf->yops only need y, so theirs is kept 
+ * for the last row. A tile in a column or row that's been seen already only works out 
+ * the rest. column can be any number that's the same for tiles that line up, it only 
+ * says where to keep the column, and the interval x says whether it's really the one. */
+interval hoisted_interval(func *sdf, scratchpad *pad, int column, interval x, interval y) {
+	int at = column % HOIST_COLUMNS;
+	int shared = sdf->xops + sdf->yops;
+	interval *kept = pad->columns + ((long) at * sdf->xops);
+	char *kept_choices = pad->column_choices + ((long) at * sdf->xops);
+	interval r;
+
+	if (pad->hoisted != sdf) {
+		memset(pad->column_nan, -1, HOIST_COLUMNS);
+		pad->row_nan = -1;
+		pad->hoisted = sdf;
 	}
 
-	free(scratch4);
-	free(scratch);
-	return 0;
+	// Sorted by simplify, so every instruction's slot is its position.
+	if ((pad->column_nan[at] < 0) || (pad->column_keys[at].lo != x.lo) || (pad->column_keys[at].hi != x.hi)) {
+		pad->column_nan[at] = interval_ops(sdf, 0, sdf->xops, pad->iscratch, pad->choices, x, y);
+		pad->column_keys[at] = x;
+		memcpy(kept, pad->iscratch, sizeof(interval) * sdf->xops);
+		memcpy(kept_choices, pad->choices, sdf->xops);
+	} else {
+		memcpy(pad->iscratch, kept, sizeof(interval) * sdf->xops);
+		memcpy(pad->choices, kept_choices, sdf->xops);
+	}
+	// The constants are in with x, and the y part may read them, so it goes second.
+	if ((pad->row_nan < 0) || (pad->row_key.lo != y.lo) || (pad->row_key.hi != y.hi)) {
+		pad->row_nan = interval_ops(sdf, sdf->xops, shared, pad->iscratch, pad->choices, x, y);
+		pad->row_key = y;
+		memcpy(pad->row, pad->iscratch + sdf->xops, sizeof(interval) * sdf->yops);
+		memcpy(pad->row_choices, pad->choices + sdf->xops, sdf->yops);
+	} else {
+		memcpy(pad->iscratch + sdf->xops, pad->row, sizeof(interval) * sdf->yops);
+		memcpy(pad->choices + sdf->xops, pad->row_choices, sdf->yops);
+	}
+
+	int maybe_nan = interval_ops(sdf, shared, sdf->size, pad->iscratch, pad->choices, x, y);
+	r = pad->iscratch[sdf->size - 1];
+	if ((maybe_nan || pad->column_nan[at] || pad->row_nan) && (r.hi < 0)) r.hi = 0;
+	return r;
 }
 
 
-/* Process one pixel using block of memory for intermediate results
+/* Process BLOCK_SIZE pixels with one pass through the function.
  *
- * memory is an array of fp_type sized max(greatest func->line value, length of func)
- * Since the language has no control flow, and every statement is an assignment, 
- * we know we will need no more than one cell per instruction. We do the simplest thing, 
- * and allocate a scratch space that size.
- * Registers for everyone!
+ * Rather than working out one pixel at a time, each instruction is carried out for the 
+ * whole block before moving on to the next, so the cost of figuring out what the 
+ * instruction is gets shared out over all of the pixels, and each one boils down to a 
+ * loop simple enough for the compiler to turn into SIMD by itself.
+ *
+ * memory is an array of fp_type sized sdf->slots * BLOCK_SIZE, holding BLOCK_SIZE 
+ * values for each slot, side by side. x and y hold BLOCK_SIZE coordinates, and out 
+ * gets BLOCK_SIZE results. Every lane gets worked out whether you want it or not, so 
+ * fill the unused ones with something harmless.
+ * Registers for everyone! (Unless allocate_registers has been at it, then you share.)
  */
-fp_type render_pixel(func *sdf, fp_type* memory, fp_type x, fp_type y) {
+int render_block(func *sdf, fp_type *memory, const fp_type *x, const fp_type *y, fp_type *out) {
 	operation* function = sdf->func; 
-	operation* funcbase = sdf->func;
-	int size = sdf->size;
-	fp_type out;
+	fp_type *dst, *a, *b;
+	fp_type imm;
+	int j;
 
-	// Only execute the const instructions on the first time through the block of memory. 
-	if ((memory[sdf->size + 1] == BEEN_INITIALIZED) && CUT_CONST) {
-		funcbase = sdf->constfree;
-		size = sdf->constfreesize;
-	}
+	if (PACKED && sdf->packed) return render_packed(sdf, memory, x, y, out);
 
-	for (int i=0; i < size; i++) {
-		function = funcbase +i;
+	for (int i=0; i < sdf->size; i++) {
+		function = sdf->func + i;
+		dst = memory + (function->line * BLOCK_SIZE);
 		switch (function->code) {
 			case VAR_X:
-				memory[function->line] = x;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = x[j];
 				break;
 			case VAR_Y:
-				memory[function->line] = y;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = y[j];
 				break;
 			case CONST:
-				memory[function->line] = function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = function->value;
 				break;
 			case NEG:
-				memory[function->line] = -memory[function->a];
+				a = memory + (function->a * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = -a[j];
 				break;
 			case SQUARE:
-				memory[function->line] = memory[function->a] * memory[function->a];
+				a = memory + (function->a * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * a[j];
 				break;
 			case SQRT:
-				memory[function->line] = sqrt_fp(memory[function->a]);
+				a = memory + (function->a * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = sqrt_fp(a[j]);
 				break;
 			case ADD:
-				memory[function->line] = memory[function->a] + memory[function->b];
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] + b[j];
 				break;
 			case SUB:
-				memory[function->line] = memory[function->a] - memory[function->b];
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] - b[j];
 				break;
 			case MUL:
-				memory[function->line] = memory[function->a] * memory[function->b];
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * b[j];
 				break;
 			case MAX:
-				memory[function->line] = fmax_fp(memory[function->a], memory[function->b]);
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmax_fp(a[j], b[j]);
 				break;
 			case MIN:
-				memory[function->line] = fmin_fp(memory[function->a], memory[function->b]);
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmin_fp(a[j], b[j]);
+				break;
+			case HYPOT:
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = sqrt_fp((a[j] * a[j]) + (b[j] * b[j]));
+				break;
+			case MAX_NEG:
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmax_fp(a[j], -b[j]);
+				break;
+			case MIN_NEG:
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmin_fp(a[j], -b[j]);
+				break;
+			case ADD_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] + imm;
+				break;
+			case SUB_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] - imm;
+				break;
+			case IMM_SUB:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = imm - a[j];
+				break;
+			case MUL_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * imm;
+				break;
+			case MAX_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmax_fp(a[j], imm);
+				break;
+			case MIN_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmin_fp(a[j], imm);
 				break;
 		}
 	}
-	out = memory[function->line];
-	memory[sdf->size + 1] = BEEN_INITIALIZED;
-	return out;
+	dst = memory + (function->line * BLOCK_SIZE);
+	for (j = 0; j < BLOCK_SIZE; j++) out[j] = dst[j];
+	return 0;
 }
 
-/* Process four pixels at once while chanting rhythmically in an interleaved scratch space in an attempt to summon the SIMDemon. 
- * Don't forget to sacrifice four times the customary memory for intermediates. */
-int render_four_pixels(func *sdf, fp_type* memory, fp_type x, fp_type y1, fp_type y2, fp_type y3, fp_type y4, quadresult * out) {
+
+/* render_block in single precision, twice the pixels per vector for half the bytes. 
+ * memory is an array of float sized sdf->slots * BLOCK_SIZE. */
+int render_block_float(func *sdf, float *memory, const float *x, const float *y, float *out) {
 	operation* function = sdf->func; 
-	operation* funcbase = sdf->func;
-	int size = sdf->size;
+	float *dst, *a, *b;
+	float imm;
+	int j;
 
-	// Only execute the const instructions on the first time through. 
-	if ((memory[sdf->size * 4 + 4] == BEEN_INITIALIZED) && CUT_CONST)  {
-		funcbase = sdf->constfree;
-		size = sdf->constfreesize;
-	} 
-	for (int i=0; i < size; i++) {
-		function = funcbase +i;
+	if (PACKED && sdf->packed) return render_packed_float(sdf, memory, x, y, out);
+
+	for (int i=0; i < sdf->size; i++) {
+		function = sdf->func + i;
+		dst = memory + (function->line * BLOCK_SIZE);
 		switch (function->code) {
 			case VAR_X:
-				memory[(function->line * 4) + 0] = x;
-				memory[(function->line * 4) + 1] = x;
-				memory[(function->line * 4) + 2] = x;
-				memory[(function->line * 4) + 3] = x;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = x[j];
 				break;
 			case VAR_Y:
-				memory[(function->line * 4) + 0] = y1;
-				memory[(function->line * 4) + 1] = y2;
-				memory[(function->line * 4) + 2] = y3;
-				memory[(function->line * 4) + 3] = y4;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = y[j];
 				break;
 			case CONST:
-				memory[(function->line * 4) + 0] = function->value;
-				memory[(function->line * 4) + 1] = function->value;
-				memory[(function->line * 4) + 2] = function->value;
-				memory[(function->line * 4) + 3] = function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = (float) function->value;
 				break;
 			case NEG:
-				memory[(function->line * 4) + 0] = -memory[(function->a * 4) + 0];
-				memory[(function->line * 4) + 1] = -memory[(function->a * 4) + 1];
-				memory[(function->line * 4) + 2] = -memory[(function->a * 4) + 2];
-				memory[(function->line * 4) + 3] = -memory[(function->a * 4) + 3];
+				a = memory + (function->a * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = -a[j];
 				break;
 			case SQUARE:
-				memory[(function->line * 4) + 0] = memory[(function->a * 4) + 0] * memory[4*function->a + 0];
-				memory[(function->line * 4) + 1] = memory[(function->a * 4) + 1] * memory[4*function->a + 1];
-				memory[(function->line * 4) + 2] = memory[(function->a * 4) + 2] * memory[4*function->a + 2];
-				memory[(function->line * 4) + 3] = memory[(function->a * 4) + 3] * memory[4*function->a + 3];
+				a = memory + (function->a * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * a[j];
 				break;
 			case SQRT:
-				memory[(function->line * 4) + 0] = sqrt_fp(memory[(function->a * 4) + 0]);
-				memory[(function->line * 4) + 1] = sqrt_fp(memory[(function->a * 4) + 1]);
-				memory[(function->line * 4) + 2] = sqrt_fp(memory[(function->a * 4) + 2]);
-				memory[(function->line * 4) + 3] = sqrt_fp(memory[(function->a * 4) + 3]);
+				a = memory + (function->a * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = sqrtf(a[j]);
 				break;
 			case ADD:
-				memory[(function->line * 4) + 0] = memory[(function->a * 4) + 0] + memory[(function->b * 4) + 0];
-				memory[(function->line * 4) + 1] = memory[(function->a * 4) + 1] + memory[(function->b * 4) + 1];
-				memory[(function->line * 4) + 2] = memory[(function->a * 4) + 2] + memory[(function->b * 4) + 2];
-				memory[(function->line * 4) + 3] = memory[(function->a * 4) + 3] + memory[(function->b * 4) + 3];
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] + b[j];
 				break;
 			case SUB:
-				memory[(function->line * 4) + 0] = memory[(function->a * 4) + 0] - memory[(function->b * 4) + 0];
-				memory[(function->line * 4) + 1] = memory[(function->a * 4) + 1] - memory[(function->b * 4) + 1];
-				memory[(function->line * 4) + 2] = memory[(function->a * 4) + 2] - memory[(function->b * 4) + 2];
-				memory[(function->line * 4) + 3] = memory[(function->a * 4) + 3] - memory[(function->b * 4) + 3];
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] - b[j];
 				break;
 			case MUL:
-				memory[(function->line * 4) + 0] = memory[(function->a * 4) + 0] * memory[(function->b * 4) + 0];
-				memory[(function->line * 4) + 1] = memory[(function->a * 4) + 1] * memory[(function->b * 4) + 1];
-				memory[(function->line * 4) + 2] = memory[(function->a * 4) + 2] * memory[(function->b * 4) + 2];
-				memory[(function->line * 4) + 3] = memory[(function->a * 4) + 3] * memory[(function->b * 4) + 3];
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * b[j];
 				break;
 			case MAX:
-				memory[(function->line * 4) + 0] = fmax_fp(memory[(function->a * 4) + 0], memory[(function->b * 4) + 0]);
-				memory[(function->line * 4) + 1] = fmax_fp(memory[(function->a * 4) + 1], memory[(function->b * 4) + 1]);
-				memory[(function->line * 4) + 2] = fmax_fp(memory[(function->a * 4) + 2], memory[(function->b * 4) + 2]);
-				memory[(function->line * 4) + 3] = fmax_fp(memory[(function->a * 4) + 3], memory[(function->b * 4) + 3]);
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmaxf(a[j], b[j]);
 				break;
 			case MIN:
-				memory[(function->line * 4) + 0] = fmin_fp(memory[(function->a * 4) + 0], memory[(function->b * 4) + 0]);
-				memory[(function->line * 4) + 1] = fmin_fp(memory[(function->a * 4) + 1], memory[(function->b * 4) + 1]);
-				memory[(function->line * 4) + 2] = fmin_fp(memory[(function->a * 4) + 2], memory[(function->b * 4) + 2]);
-				memory[(function->line * 4) + 3] = fmin_fp(memory[(function->a * 4) + 3], memory[(function->b * 4) + 3]);
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fminf(a[j], b[j]);
+				break;
+			case HYPOT:
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = sqrtf((a[j] * a[j]) + (b[j] * b[j]));
+				break;
+			case MAX_NEG:
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmaxf(a[j], -b[j]);
+				break;
+			case MIN_NEG:
+				a = memory + (function->a * BLOCK_SIZE);
+				b = memory + (function->b * BLOCK_SIZE);
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fminf(a[j], -b[j]);
+				break;
+			case ADD_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = (float) function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] + imm;
+				break;
+			case SUB_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = (float) function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] - imm;
+				break;
+			case IMM_SUB:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = (float) function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = imm - a[j];
+				break;
+			case MUL_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = (float) function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * imm;
+				break;
+			case MAX_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = (float) function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmaxf(a[j], imm);
+				break;
+			case MIN_IMM:
+				a = memory + (function->a * BLOCK_SIZE);
+				imm = (float) function->value;
+				for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fminf(a[j], imm);
 				break;
 		}
 	}
-	out->one   = memory[(function->line * 4) + 0];
-	out->two   = memory[(function->line * 4) + 1];
-	out->three = memory[(function->line * 4) + 2];
-	out->four  = memory[(function->line * 4) + 3];
-	memory[(sdf->size * 4) + 4] = BEEN_INITIALIZED; 
+	dst = memory + (function->line * BLOCK_SIZE);
+	for (j = 0; j < BLOCK_SIZE; j++) out[j] = dst[j];
 	return 0;
 }
 
 
 /* write out an 8-bit ppm image file */
-int write_ppm(const char * filename, char * data, int size) {
+int write_ppm(const char * filename, char * data, int width, int height) {
+	FILE * fp = fopen(filename, "wb");
+	if (!fp) {
+		fprintf(stderr, "Unable to open %s for writing\n", filename);
+		return 0;
+	}
+	fprintf(fp, "P5\n%d %d\n255\n", width, height);
+	fwrite(data, (long) width * height, 1, fp);
+	fclose(fp);
+	return 1;
+}
+
+
+/* write out a mask from render_mask as a 1-bit pbm image file */
+int write_pbm(const char * filename, const unsigned char * bits, int width, int height) {
+	FILE * fp = fopen(filename, "wb");
+	if (!fp) {
+		fprintf(stderr, "Unable to open %s for writing\n", filename);
+		return 0;
+	}
+	fprintf(fp, "P4\n%d %d\n", width, height);
+	fwrite(bits, (long) MASK_STRIDE(width) * height, 1, fp);
+	fclose(fp);
+	return 1;
+}
+
+
+/* write out a mask from render_mask as an 8-bit ppm image file, like write_ppm, for 
+ * whatever can't read a pbm. Unpacked a row at a time, so it takes no more memory. */
+int write_mask_ppm(const char * filename, const unsigned char * bits, int width, int height) {
 	FILE * fp = fopen(filename, "wb");
-	fprintf(fp, "P5\n%d %d\n255\n", IMAGE_SIZE, IMAGE_SIZE);
-	fwrite(data, size, 1, fp);
+	char *row = (char *) malloc(width);
+	if (!(fp && row)) {
+		fprintf(stderr, "Unable to open %s for writing\n", filename);
+		if (fp) fclose(fp);
+		free(row);
+		return 0;
+	}
+	fprintf(fp, "P5\n%d %d\n255\n", width, height);
+	for (int i = 0; i < height; i++) {
+		unpack_mask_row(bits + ((long) i * MASK_STRIDE(width)), width, row);
+		fwrite(row, width, 1, fp);
+	}
+	free(row);
 	fclose(fp);
 	return 1;
 }
 
 
+/* Pack n pixels, a byte each, 0 or 255, into bits, the way render_mask lays them out. 
+ * With SSE2, the top bit of every byte comes out sixteen at a time with movemask, 
+ * after flipping each run of eight end for end, so the first pixel lands in the 
+ * top bit. A short last byte gets zeros for padding. */
+void pack_mask_row(const char *row, int n, unsigned char *bits) {
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (row + i));
+		// Reverse the words in each half, then the bytes in each word.
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0x1b), 0x1b);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		int m = ~_mm_movemask_epi8(v);
+		bits[i / 8] = m & 0xff;
+		bits[(i / 8) + 1] = (m >> 8) & 0xff;
+	}
+#endif
+	for (; i < n; i += 8) {
+		unsigned char b = 0;
+		for (int j = 0; j < 8; j++) {
+			b = (b << 1) | ((i + j < n) && !row[i + j]);
+		}
+		bits[i / 8] = b;
+	}
+}
+
+
+/* The other way, n pixels of bits back out to bytes of 0 or 255. */
+void unpack_mask_row(const unsigned char *bits, int n, char *row) {
+	for (int i = 0; i < n; i++) {
+		row[i] = ((bits[i >> 3] >> (7 - (i & 7))) & 1) ? 0 : 255;
+	}
+}
+
+
+/* Count the pixels that differ between two images of the same size, and list the first few. */
+long diff_images(const char *reference, const char *data, long size, int stride) {
+	long count = 0;
+	for (long i = 0; i < size; i++) {
+		if (reference[i] != data[i]) {
+			if (count < 10) {
+				fprintf(stderr, "Pixel %ld, %ld: expected %s, got %s\n", i % stride, i / stride,
+						reference[i] ? "inside" : "outside", data[i] ? "inside" : "outside");
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+
 /* Chop up the -1/1 space into an array of size evenly spaced floats. 
  * Caller must free memory */
 fp_type* linspace(int size) {
 	fp_type step = 2.0 / size;
-	fp_type* out = (fp_type*)  malloc(sizeof(fp_type) * size + 1);
+	fp_type* out = (fp_type*)  malloc(sizeof(fp_type) * (size + 1));
 	if (!out) {
 		fprintf(stderr, "Memory allocation failed.\n");
 		exit(1);
@@ -496,145 +2106,146 @@ fp_type* linspace(int size) {
 }
 
 
-/* Make a copy of the function with const operations removed. */
-int cut_const(func *sdf) {
-	sdf->constfree = (operation *) malloc(sizeof(operation) * (sdf->size + 1));
-	if (!sdf->constfree) {
+/* Like linspace, but size steps of step starting from start. 
+ * Caller must free memory */
+fp_type* axis(fp_type start, fp_type step, int size) {
+	fp_type* out = (fp_type*)  malloc(sizeof(fp_type) * (size + 1));
+	if (!out) {
 		fprintf(stderr, "Memory allocation failed.\n");
 		exit(1);
 	}
-
-	operation *output = sdf->constfree;
-	for (int i = 0; i < sdf->size; i++) {
-		if (sdf->func[i].code != CONST) {
-			memcpy(output, &sdf->func[i], sizeof(operation));
-			output += 1;
-			sdf->constfreesize += 1;
-
-		}
+	out[0] = start;
+	for (int i=1; i<=size; i++) {
+		out[i] = out[i-1] + step;
 	}
-
-	sdf->constfree = (operation *) realloc(sdf->constfree, sizeof(operation) * sdf->constfreesize);
-	return sdf->size - sdf->constfreesize;
+	return out;
 }
 
 
-/* fold constants in one operator and its operand(s) recursively. */
-int fold_const_operator(func *sdf, operation *oper) {
-	int count = 0;
-	int a, b;
-	operation *func = sdf->func;
+/* Reassign scratch slots so a slot gets reused once the value in it has been read for 
+ * the last time. Modifies the function in-place and sets sdf->slots.
+ *
+ * The first pass finds the last reader of every value, the second walks the function 
+ * handing out slots from a stack of free ones, most recently freed first, so the 
+ * values in flight stay bunched up at the bottom of the scratch.
+ *
+ * Anything that relies on line numbers being unique (optimize) has to run first.
+ * Returns the peak number of values live at once. */
+int allocate_registers(func *sdf) {
+	int size = sdf->size;
+	int *last_use = (int *) malloc(sizeof(int) * size);
+	int *producer = (int *) malloc(sizeof(int) * sdf->slots);
+	int *newslot = (int *) malloc(sizeof(int) * size);
+	int *free_slots = (int *) malloc(sizeof(int) * size);
+	if (!(last_use && producer && newslot && free_slots)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	int nfree = 0, nslots = 0, live = 0, peak = 0;
+	int a = 0, b = 0, operands, i;
+	operation *oper;
 
-	switch (oper->code) {
-		case VAR_X:
-		case VAR_Y:
-		case CONST:
-			return count;
-		case NEG:
-			a = oper->a;
-			count += fold_const_operator(sdf, func+a);
-			if (sdf->func[a].code == CONST) {
-				printf("found NEG\t");
-				oper->code = CONST;
-				oper->value = -(func[a].value);
-				return count + 1;
-			}
-			return count;
-		case SQUARE:
-			a = oper->a;
-			count += fold_const_operator(sdf, func+a);
-			if (sdf->func[a].code == CONST) {
-				printf("found SQUARE\t");
-				oper->code = CONST;
-				oper->value = sdf->func[a].value * sdf->func[a].value;
-				return count + 1;
-			}
-			return count;
-		case SQRT:
-			a = oper->a;
-			count += fold_const_operator(sdf, func+a);
-			if ((func+a)->code == CONST) {
-				printf("found SQRT\t");
-				oper->code = CONST;
-				oper->value = sqrt_fp(sdf->func[a].value);
-				return count + 1;
-			}
-			return count;
-		case ADD:
-			a = oper->a;
-			b = oper->b;
-			count += fold_const_operator(sdf, &sdf->func[a]);
-			count += fold_const_operator(sdf, &sdf->func[b]);
-			printf("ADD: %d,%d\n", (func+a)->code, sdf->func[b].code);
-			if ((sdf->func[a].code == CONST) && (sdf->func[b].code == CONST))  {
-				printf("found ADD\t");
-				oper->code = CONST;
-				oper->value = sdf->func[a].value + sdf->func[b].value;
-				return count + 1;
-			}
-			return count;
-		case SUB:
-			a = oper->a;
-			b = oper->b;
-			count += fold_const_operator(sdf, &sdf->func[a]);
-			count += fold_const_operator(sdf, &sdf->func[b]);
-			if ((sdf->func[a].code == CONST) && (sdf->func[b].code == CONST))  {
-				printf("found SUB\t");
-				oper->code = CONST;
-				oper->value = sdf->func[a].value - sdf->func[b].value;
-				return count + 1;
-			}
-			return count;
-		case MUL:
-			a = oper->a;
-			b = oper->b;
-			count += fold_const_operator(sdf, &sdf->func[a]);
-			count += fold_const_operator(sdf, &sdf->func[b]);
-			if ((sdf->func[a].code == CONST) && (sdf->func[b].code == CONST))  {
-				printf("found MUL\t");
-				oper->code = CONST;
-				oper->value = sdf->func[a].value * sdf->func[b].value;
-				return count + 1;
-			}
-			return count;
-		case MAX:
-			a = oper->a;
-			b = oper->b;
-			count += fold_const_operator(sdf, &sdf->func[a]);
-			count += fold_const_operator(sdf, &sdf->func[b]);
-			if ((sdf->func[a].code == CONST) && (sdf->func[b].code == CONST))  {
-				printf("found MAX\t");
-				oper->code = CONST;
-				oper->value = fmax_fp(sdf->func[a].value, sdf->func[b].value);
-				return count + 1;
-			}
-			return count;
-		case MIN:
-			a = oper->a;
-			b = oper->b;
-			count += fold_const_operator(sdf, &sdf->func[a]);
-			count += fold_const_operator(sdf, &sdf->func[b]);
-			if ((sdf->func[a].code == CONST) && (sdf->func[b].code == CONST))  {
-				printf("found MIN\t");
-				oper->code = CONST;
-				oper->value = fmin_fp(sdf->func[a].value, sdf->func[b].value);
-				return count + 1;
-			}
-			return count;
+	for (i = 0; i < size; i++) {
+		oper = sdf->func + i;
+		last_use[i] = -1;
+		switch (oper->code) {
+			case VAR_X:
+			case VAR_Y:
+			case CONST:
+				break;
+			case NEG:
+			case SQUARE:
+			case SQRT:
+			case ADD_IMM:
+			case SUB_IMM:
+			case IMM_SUB:
+			case MUL_IMM:
+			case MAX_IMM:
+			case MIN_IMM:
+				last_use[producer[oper->a]] = i;
+				break;
+			case ADD:
+			case SUB:
+			case MUL:
+			case MAX:
+			case MIN:
+			case HYPOT:
+			case MAX_NEG:
+			case MIN_NEG:
+				last_use[producer[oper->a]] = i;
+				last_use[producer[oper->b]] = i;
+				break;
+		}
+		producer[oper->line] = i;
 	}
-	fprintf(stderr, "Found bad opcode %d in constant folder\n", oper->code);
-	return 0;
-}
+	last_use[size - 1] = size; // The output had better survive.
+
+	for (i = 0; i < size; i++) {
+		oper = sdf->func + i;
+		operands = 0;
+		switch (oper->code) {
+			case VAR_X:
+			case VAR_Y:
+			case CONST:
+				break;
+			case NEG:
+			case SQUARE:
+			case SQRT:
+			case ADD_IMM:
+			case SUB_IMM:
+			case IMM_SUB:
+			case MUL_IMM:
+			case MAX_IMM:
+			case MIN_IMM:
+				a = producer[oper->a];
+				oper->a = newslot[a];
+				operands = 1;
+				break;
+			case ADD:
+			case SUB:
+			case MUL:
+			case MAX:
+			case MIN:
+			case HYPOT:
+			case MAX_NEG:
+			case MIN_NEG:
+				a = producer[oper->a];
+				b = producer[oper->b];
+				oper->a = newslot[a];
+				oper->b = newslot[b];
+				operands = (a == b) ? 1 : 2;
+				break;
+		}
+		producer[oper->line] = i;
 
+		// Operands are always read before the result is written, so the result can 
+		// go straight into the slot of an operand that dies here.
+		if ((operands >= 1) && (last_use[a] == i)) {
+			free_slots[nfree++] = newslot[a];
+			live--;
+		}
+		if ((operands == 2) && (last_use[b] == i)) {
+			free_slots[nfree++] = newslot[b];
+			live--;
+		}
 
-/* Fold constants. Modifies the funtion in-place by converting operations where all operands are 
- * constants into constants. */
-int fold_const(func *sdf) {
-	int count = 0;
-	for (int i = 0; i < sdf->size; i++) {
-		count += fold_const_operator(sdf, sdf->func + i);
+		newslot[i] = nfree ? free_slots[--nfree] : nslots++;
+		live++;
+		if (live > peak) peak = live;
+		if (last_use[i] < 0) {
+			// Nobody reads it. It still has to go somewhere.
+			free_slots[nfree++] = newslot[i];
+			live--;
+		}
+		oper->line = newslot[i];
 	}
-	return count;
+
+	sdf->slots = nslots;
+	free(last_use);
+	free(producer);
+	free(newslot);
+	free(free_slots);
+	return peak;
 }
 
 
@@ -8,19 +8,150 @@
  *
  */
 
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
 #define IMAGE_SIZE 1024
 #define FILENAME "prospero.vm"
 #define OUTFILE "out.ppm"
 
-// Fold operations with constants for operands
-#define FOLD_CONST 0  
+// Wants a struct timespec start_time, end_time in scope, and <time.h>.
+#define START_TIMER clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_time);
+#define PRINT_TIMER clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end_time); \
+printf("cpu time: %f", (end_time.tv_sec - start_time.tv_sec) + ((end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0));
+
+// Optimize the function before rendering it: fold constants, merge common subexpressions, 
+// rewrite a few things into cheaper things and drop dead code (0 to disable).
+// This and FUSE can be overridden with -D, which is how make bench sweeps them.
+#ifndef OPTIMIZE
+#define OPTIMIZE 1
+#endif
+
+// Fuse common chains of instructions into single bigger ones (0 to disable)
+#ifndef FUSE
+#define FUSE 1
+#endif
 
-// Only execute const loads on first run through scratch memory (0 to disable)
-#define CUT_CONST 1
+// Give instructions that read a constant the number itself, instead of a scratch slot
+// to load it from (0 to disable)
+#define IMMEDIATES 1
+
+// Give the interpreter an 8 byte copy of each instruction and run it with computed goto 
+// instead of a switch (0 to disable). This and INTERVAL_CULL can be overridden with -D, 
+// which is how make bench-dispatch sweeps them.
+#ifndef PACKED
+#define PACKED 1
+#endif
+
+// Reuse scratch slots once the values in them are dead, so the working set fits in cache (0 to disable)
+#define REGISTER_ALLOC 1
+
+// Count where the time goes: per thread, per tile and per instruction, see profile.c 
+// (1 to enable). PROFILE_PERF adds the CPU's own counters from perf_event_open, which 
+// needs Linux and PROFILE. make profile builds machine_profile with both.
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+#ifndef PROFILE_PERF
+#define PROFILE_PERF 0
+#endif
 
 // Number of threads to spawn, 0 for single-threaded.
 #define NUM_THREADS 8
 
+// Pin every worker thread of a renderer from create_pinned_renderer to a CPU of its
+// own, NUMA node by node, each node's first hyperthreads before their siblings. Only
+// if there's an allowed CPU for every worker. create_renderer never pins, so library
+// callers with more than one renderer don't pile them onto the same CPUs (0 to disable)
+#define PIN_THREADS 1
+
+// With PIN_THREADS, deal the workers out to the nodes in turn instead of filling up
+// one node before starting on the next (0 to disable)
+#define PIN_SPREAD 0
+
+// Back each worker's scratch with huge pages: 0 for none, 1 to ask for transparent
+// ones, 2 for explicit ones from the hugetlb pool, with transparent ones if it's empty
+#define SCRATCH_HUGE_PAGES 1
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// Give each NUMA node its own copy of the function a job renders, on the node (0 to disable)
+#define REPLICATE_TAPE 1
+#define MAX_NODES 64
+
+// Keep compiled tapes of every .vm file loaded in TAPE_CACHE_DIR, and load those instead
+// of parsing when the source hasn't changed (0 to disable)
+#define TAPE_CACHE 1
+#define TAPE_CACHE_DIR ".tapes"
+
+// Most threads to parse a file with, and the fewest bytes worth giving one of them.
+#define PARSE_THREADS 8
+#define PARSE_CHUNK (1 << 20)
+// Highest operand name a file can use, _ffffff. Every name up to the highest gets a slot.
+#define PARSE_MAX_NAME 0xffffff
+// Room for the file name, line and text of whatever is wrong with a file.
+#define PARSE_ERROR_SIZE 512
+
+// Classify tiles with interval arithmetic, only render pixels in tiles that straddle the edge (0 to disable)
+#ifndef INTERVAL_CULL
+#define INTERVAL_CULL 1
+#endif
+
+// Edge length in pixels of the tiles the quadtree starts from, a multiple of 8 so a tile 
+// of a mask is whole bytes across
+#define TILE_SIZE 64
+
+// Drop the MIN and MAX branches that can't win inside a tile before looking closer (0 to disable)
+#define SIMPLIFY_TAPE 1
+
+// Whether the whole function, and with it the JIT's code, ever gets as far as pixels.
+// With both of the above, every pixel is done from a simplified tape on the interpreter.
+#define JIT_REACHES_PIXELS (!INTERVAL_CULL || !SIMPLIFY_TAPE)
+
+// Work out the intervals of the parts of the function that only need x once for a column
+// of tiles, and of the parts that only need y once for a row, instead of for every tile
+// (0 to disable)
+#define HOIST_SEPARABLE 1
+
+// Columns of tiles a worker keeps the intervals of the x part for
+#define HOIST_COLUMNS 64
+
+// Don't bother unless one instruction in this many only needs x or y
+#define HOIST_SHARE 8
+
+// Pixels per pass through the function in render_block. Anything from 64 to 1024 makes sense,
+// MIN_TILE squared fits a whole tile in one pass.
+#define BLOCK_SIZE 64
+
+// Tiles this size or smaller are rendered pixel by pixel instead of subdivided
+#define MIN_TILE 8
+
+// Pixels between samples in the first pass of render_progressive, a power of two
+#define PROGRESSIVE_STEP 16
+
+// Bytes in a row of a mask from render_mask, a bit a pixel
+#define MASK_STRIDE(width) (((width) + 7) / 8)
+
+// Rows of the image render_stream renders and writes out at a time
+#define STREAM_ROWS 256
+
+// Compiled tapes and rendered tiles the render server keeps, and the biggest image it makes
+#define SERVER_TAPES 8
+#define SERVER_TILES 65536
+#define SERVER_MAX_SIZE 16384
+
+// How render_progressive marks the pixels of the image
+#define GUESS_PIXEL 0
+#define NEED_PIXEL 1
+#define KNOWN_PIXEL 2
+
+// What simplify finds an instruction depends on, or'd together: neither is a constant.
+#define DEPENDS_X 1
+#define DEPENDS_Y 2
+// Which part of a simplified function an instruction goes in, by its live in simplify,
+// 1 + what it depends on: 0 for x or nothing, 1 for y, 2 for both.
+#define HOIST_GROUP(live) (((live) == 1 + (DEPENDS_X | DEPENDS_Y)) ? 2 : ((live) == 1 + DEPENDS_Y))
+
 // Use double precision floating point
 #define DOUBLE
 
@@ -30,59 +161,407 @@ typedef double fp_type;
 #define sqrt_fp sqrt
 #define fmax_fp fmax
 #define fmin_fp fmin
+// Integers up to here, and powers of ten up to 10^this, are exact in fp_type
+#define FP_MANTISSA_MAX (1ULL << 53)
+#define FP_EXACT_POW10 22
+#else
+typedef float fp_type;
+#define strto_fp strtof
+#define sqrt_fp sqrtf
+#define fmax_fp fmaxf
+#define fmin_fp fminf
+#define FP_MANTISSA_MAX (1ULL << 24)
+#define FP_EXACT_POW10 10
 #endif
 
-#define BEEN_INITIALIZED 1.0
+// In mixed precision, pixels the float pass puts closer to zero than this get done over in fp_type.
+// Float is off by at most 8.4e-7 anywhere in prospero.vm.
+#define MIXED_BOUND 1e-5
+
+// Which evaluator renders the pixels, picked at run time. Tiles are always classified in fp_type.
+enum precision {PRECISION_DOUBLE, PRECISION_FLOAT, PRECISION_MIXED};
 
-enum opcode {VAR_X, VAR_Y, CONST, ADD, SUB, MUL, MAX, MIN, NEG, SQUARE, SQRT};
+// From HYPOT on, they never turn up in a file. fuse makes these out of chains of the others:
+// HYPOT a b is sqrt(a*a + b*b), MAX_NEG a b is max(a, -b), MIN_NEG a b is min(a, -b).
+// And lower_immediates makes the _IMM ones, which take a and value: ADD_IMM is a + value,
+// SUB_IMM is a - value, IMM_SUB is value - a, and so on.
+enum opcode {VAR_X, VAR_Y, CONST, ADD, SUB, MUL, MAX, MIN, NEG, SQUARE, SQRT, HYPOT, MAX_NEG, MIN_NEG,
+	ADD_IMM, SUB_IMM, IMM_SUB, MUL_IMM, MAX_IMM, MIN_IMM};
+
+// Which operand of a MIN or MAX wins everywhere in a region
+enum choice {CHOICE_BOTH, CHOICE_A, CHOICE_B};
 
 typedef struct {
 	int line;
 	enum opcode code;
-	union {
-		fp_type value;
-		struct {int a; int b;};
-	};
+	int a;
+	int b;
+	fp_type value;	// for CONST and the _IMM opcodes
 } operation;
 
+// The interpreter's copy of an operation, a third of the size. For CONST and the _IMM 
+// opcodes, b is where to find the value in the pool. Everything has to fit in 16 bits, 
+// or the function doesn't get one.
 typedef struct {
+	uint8_t code;
+	uint8_t unused;
+	uint16_t line;
+	uint16_t a;
+	uint16_t b;
+} packed_op;
+
+// Marks the end of a packed function
+#define PACKED_END (MIN_IMM + 1)
+
+// Largest slot or pool entry that fits in a packed_op
+#define PACKED_MAX 65535
+
+// Native code from jit_compile: takes width x and y values, writes width results
+typedef void (*jit_fn)(const fp_type *x, const fp_type *y, fp_type *out);
+
+// The widest a jit_fn ever goes
+#define JIT_MAX_WIDTH 4
+
+typedef struct {
+	jit_fn fn;
+	int width;
+	void *code;
+	size_t codesize;
+} jit_code;
+
+typedef struct func {
 	int size;
+	int slots;
 	operation* func;
-	int constfreesize;
-	operation* constfree;
+	jit_code *jit;
+	packed_op *packed;	// the interpreter's copy, null if there isn't one
+	fp_type *pool;		// values for packed
+	void *mapping;		// func lives in here if it came from a tape
+	size_t mapsize;
+	int xops;		// from simplify with separate: the first xops depend on x at most,
+	int yops;		// the yops after them on y at most, and the rest on both
+	struct func *sorted;	// from separate_func, a copy sorted like that, or null
 } func;
 
 typedef struct {
+	fp_type lo, hi;
+} interval;
+
+// What optimize did, by the instruction
+typedef struct {
+	int folded;	// turned into constants
+	int merged;	// same as one before it
+	int rewritten;	// turned into something simpler
+	int dead;	// not needed for the output
+} optimize_stats;
+
+// What fuse did, by the fused instruction
+typedef struct {
+	int hypot;
+	int max_neg;
+	int min_neg;
+} fuse_stats;
+
+// What part of the plane to render: centred on x, y and 2 * scale wide.
+// {0, 0, 1} is the -1 to 1 square the challenge asks for.
+typedef struct {
+	fp_type x, y;
+	fp_type scale;
+} viewport;
+
+// Cycles, L1d misses, LLC misses and branch misses
+#define PERF_COUNTERS 4
+
+// What one worker has been up to, with PROFILE
+typedef struct {
+	double busy;		// seconds on tiles
+	long tiles;
+	long intervals;
+	long blocks;
+	long points;
+	long ops[PACKED_END];	// instructions run, one per block
+	uint64_t counts[PERF_COUNTERS];
+	int perf_fd[PERF_COUNTERS];
+	int perf_leader;
+	int perf_open;
+} profile;
+
+// One thread's working memory, big enough for the largest function it has rendered yet.
+typedef struct {
+	profile *prof;		// where to count things with PROFILE, if anywhere
+	int precision;
+	int slots;
+	int ops;
+	fp_type *scratch;
+	interval *iscratch;
+	fp_type *tscratch;
+	float *fscratch;
+	float *ftscratch;
+	// hoisted_interval's copies of the x part of sorted for HOIST_COLUMNS columns, and
+	// the y part for one row: which intervals they're for, and whether they might be NaN,
+	// or -1 for none yet. Only good for the tape in hoisted, and only room for hoist_x
+	// and hoist_y operations.
+	const func *hoisted;
+	int hoist_x;
+	int hoist_y;
+	interval *columns;
+	char *column_choices;
+	interval *column_keys;
+	char *column_nan;
+	interval *row;
+	char *row_choices;
+	interval row_key;
+	int row_nan;
+	char *choices;
+	int *producer;
+	int *alias;
+	int *srca;
+	int *srcb;
+	int *slot;
+	char *live;
+	void *arena;		// everything above comes out of this, a cache line apiece
+	size_t arena_size;
+} scratchpad;
+
+// The tiles one worker has left, tiles[head] to tiles[tail - 1]
+typedef struct {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+} tile_deque;
+
+typedef struct render_job {
 	func *sdf;
-	int startidx;
-	int size;
-	int stride;
+	const fp_type *xspace;
+	const fp_type *yspace;
 	char *data;
-	fp_type *space;
-} chunk_args;
+	int width;
+	int height;
+	int tile_size;		// TILE_SIZE, but bigger for the early passes of render_progressive
+	int tiles_across;
+	int tiles_down;
+	int precision;
+	int num_workers;
+	tile_deque *deques;
+	// For a pass of render_progressive: only the pixels marked NEED_PIXEL here get 
+	// rendered, straight into data.
+	char *mask;
+	int bits;		// data is a mask like render_mask's, not a byte a pixel
+	const int *tiles;	// if set, the tiles to render, the rest are skipped
+	// For render_views: an image per view, each numbering its tiles from first_tile, 
+	// with sdf and precision from the job
+	const struct render_job *parts;
+	int nparts;
+	int first_tile;
+	float *heat;		// with PROFILE, seconds each tile took, if set
+} render_job;
 
-void * start_thread(void * args);
+struct renderer;
+
+typedef struct {
+	pthread_t thread;
+	struct renderer *owner;
+	int id;
+	int cpu;		// pinned to, or -1
+	int node;		// of cpu, numbered from 0 among the renderer's nodes
+	scratchpad pad;
+	profile prof;
+} worker;
+
+// One NUMA node's copy of the function being rendered, checked for the job of generation
+// by the first of the node's workers to get to it, and made again if the function changed
+typedef struct {
+	pthread_mutex_t lock;
+	int generation;
+	func tape;
+} node_tape;
+
+// A pool of worker threads that lives from create_renderer to free_renderer.
+// Workers sleep until generation moves, render the job, and count running down to 0.
+typedef struct renderer {
+	int num_workers;
+	int threaded;
+	worker *workers;
+	tile_deque *deques;
+	render_job job;
+	pthread_mutex_t busy;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t finish;
+	int generation;
+	int running;
+	int quit;
+	double wall;		// with PROFILE, seconds the workers have had jobs
+	float *heat;		// with PROFILE, where the next render puts its tile times, if set
+	int num_nodes;		// NUMA nodes the workers are pinned to, 1 if they aren't
+	node_tape *tapes;	// with REPLICATE_TAPE and more than one node, one per node
+} renderer;
 
+// One view of a batch for render_views, and the mask like render_mask's it goes into
 typedef struct {
-	fp_type one, two, three, four;
-} quadresult;
+	viewport view;
+	int width;
+	int height;
+	unsigned char *data;
+} batch_view;
+
+// Called by render_progressive after every pass, with the whole image so far and the 
+// spacing of the pixels it was worked out from. Return nonzero to stop there.
+typedef int (*progress_fn)(const char *data, int width, int height, int step, void *user);
+
+// The library: load a function, make a renderer, render views of it.
+
+func *load_func(const char *filename, int verbose);
+
+func *try_load_func(const char *filename, int verbose, char *error, int errsize);
 
-int parse_line(const char* line, operation* op);
+void free_func(func *sdf);
+
+renderer *create_renderer(int num_threads);
+
+renderer *create_pinned_renderer(int num_threads);
+
+int render_view(renderer *r, func *sdf, const viewport *view, int width, int height, int precision, char *data);
+
+int render_progressive(renderer *r, func *sdf, const viewport *view, int width, int height, int precision, 
+		char *data, progress_fn callback, void *user);
+
+int render_mask(renderer *r, func *sdf, const viewport *view, int width, int height, int precision, unsigned char *bits);
+
+int render_views(renderer *r, func *sdf, int n, batch_view *views, int precision);
+
+int render_tile_set(renderer *r, func *sdf, const fp_type *xspace, const fp_type *yspace, int width, int height, int precision, 
+		unsigned char *bits, const int *tiles, int ntiles);
+
+int render_stream(renderer *r, func *sdf, const viewport *view, int width, int height, int precision, const char *filename, int bits);
+
+int render_distributed(func *sdf, const viewport *view, int width, int height, int precision, int num_procs, char *data, int bits);
+
+void free_renderer(renderer *r);
+
+// The works.
+
+void * start_thread(void * args);
+
+int render_tiles(render_job *job, int id, scratchpad *pad);
+
+void view_axes(const viewport *view, int width, int height, fp_type **xspace, fp_type **yspace);
+
+int serve_tiles(int fd);
+
+int serve(const char *path, int num_threads);
+
+double profile_clock(void);
+
+void profile_init(profile *p);
+
+void profile_free(profile *p);
+
+void profile_tape(profile *p, const func *sdf, int n);
+
+void profile_start(profile *p);
+
+void profile_stop(profile *p);
+
+void print_profile(renderer *r);
+
+void reset_profile(renderer *r);
+
+int write_heatmap(const char *filename, const float *heat, int across, int down);
+
+int cpu_order(int *cpus, int *nodes, int max);
+
+void pin_thread(int cpu);
+
+void *arena_alloc(size_t size, size_t *mapped);
+
+void arena_free(void *arena, size_t mapped);
+
+func *node_func(renderer *r, int node, const func *sdf, int generation);
+
+void free_node_tapes(renderer *r);
 
 func parse_file(const char* filename);
 
-int render_chunk(func *sdf, int startidx, int size, int stride, char *data, fp_type *space);
+int arity(enum opcode code);
+
+int parse_func(const char *filename, func *out, char *error, int errsize);
 
-fp_type render_pixel(func *sdf, fp_type* memory, fp_type x, fp_type y);
+int hash_file(const char *filename, uint64_t *hash);
 
-int render_four_pixels(func *sdf, fp_type* memory, fp_type x, fp_type y1, fp_type y2, fp_type y3, fp_type y4, quadresult * out);
+int tape_cache_path(char *path, size_t len, uint64_t source);
 
-int write_ppm(const char * filename, char * data, int size);
+int write_tape(const char *filename, func *sdf, uint64_t source);
+
+int load_tape(const char *filename, func *out, uint64_t source);
+
+int next_tile(render_job *job, int id);
+
+void scratchpad_init(scratchpad *pad);
+
+int scratchpad_reserve(scratchpad *pad, func *sdf, int precision);
+
+void scratchpad_free(scratchpad *pad);
+
+int render_chunk(func *sdf, scratchpad *pad, int x, int y, int w, int h, char *data, int stride, const fp_type *xspace, const fp_type *yspace);
+
+int render_block(func *sdf, fp_type *memory, const fp_type *x, const fp_type *y, fp_type *out);
+
+int render_block_float(func *sdf, float *memory, const float *x, const float *y, float *out);
+
+int pack_func(func *sdf);
+
+int render_packed(func *sdf, fp_type *memory, const fp_type *x, const fp_type *y, fp_type *out);
+
+int render_packed_float(func *sdf, float *memory, const float *x, const float *y, float *out);
+
+int render_batch(func *sdf, scratchpad *pad, int short_tape, int n, fp_type *xs, fp_type *ys, fp_type *out);
+
+int render_masked(func *sdf, scratchpad *pad, int x, int y, int w, int h, char *mask, char *data, int stride, const fp_type *xspace, const fp_type *yspace);
+
+int render_rect(func *sdf, scratchpad *pad, int short_tape, int x, int y, int w, int h, char *data, int stride, const fp_type *xspace, const fp_type *yspace);
+
+int render_tile(func *sdf, scratchpad *pad, int x, int y, int w, int h, char *data, int stride, const fp_type *xspace, const fp_type *yspace);
+
+interval interval_square(interval a);
+
+interval render_interval(func *sdf, interval *memory, char *choices, interval x, interval y);
+
+interval hoisted_interval(func *sdf, scratchpad *pad, int column, interval x, interval y);
+
+int simplify(func *sdf, scratchpad *pad, int separate, func *out);
+
+void separate_func(func *sdf);
+
+int fill_tile(char *data, int stride, int w, int h, char value);
+
+int write_ppm(const char * filename, char * data, int width, int height);
+
+int write_pbm(const char * filename, const unsigned char * bits, int width, int height);
+
+int write_mask_ppm(const char * filename, const unsigned char * bits, int width, int height);
+
+void pack_mask_row(const char *row, int n, unsigned char *bits);
+
+void unpack_mask_row(const unsigned char *bits, int n, char *row);
+
+long diff_images(const char *reference, const char *data, long size, int stride);
 
 fp_type* linspace(int size);
 
-int cut_const(func * sdf);
+fp_type* axis(fp_type start, fp_type step, int size);
+
+
+int allocate_registers(func * sdf);
+
+int optimize(func *sdf, optimize_stats *stats);
+
+int fuse(func *sdf, fuse_stats *stats);
+
+int lower_immediates(func *sdf);
+
+jit_code *jit_compile(func *sdf);
 
-int fold_const(func * sdf);
+void jit_free(jit_code *jit);
 
-int fold_const_operator(func *sdf, operation *oper);
+int compare_jit(func *sdf, fp_type *space, int size);
@@ -0,0 +1,375 @@
+/*
+ * main.c
+ *
+ * Command line front end for the Prospero Challenge renderer in libmachine.
+ * https://www.mattkeeter.com/projects/prospero/
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Does filename end in .pbm? Those get written a bit a pixel. */
+static int is_pbm(const char *filename) {
+	size_t len = strlen(filename);
+	return (len >= 4) && (strcmp(filename + len - 4, ".pbm") == 0);
+}
+
+
+/* write_ppm, or write_pbm if filename asks for one, for an image of a byte a pixel. */
+static int write_image(const char *filename, const char *data, int width, int height) {
+	if (!is_pbm(filename)) return write_ppm(filename, (char *) data, width, height);
+	unsigned char *bits = (unsigned char *) malloc((long) MASK_STRIDE(width) * height);
+	if (!bits) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (int i = 0; i < height; i++) pack_mask_row(data + ((long) i * width), width, bits + ((long) i * MASK_STRIDE(width)));
+	int ok = write_pbm(filename, bits, width, height);
+	free(bits);
+	return ok;
+}
+
+
+/* Render every view listed in batchfile, one to a line as
+ *   x y scale width height outfile
+ * with blank lines and lines starting with # skipped, all in one go with render_views, 
+ * and write each one out to its file. */
+static int run_batch(const char *batchfile, func *sdf, int num_threads, int precision) {
+	struct timespec start_time, end_time;
+	char line[4608], name[4096];
+	double x, y, scale;
+	int n = 0, room = 16, lineno = 0;
+	long pixels = 0;
+
+	FILE *fp = fopen(batchfile, "r");
+	if (!fp) {
+		fprintf(stderr, "Unable to open %s\n", batchfile);
+		exit(1);
+	}
+	batch_view *views = (batch_view *) malloc(sizeof(batch_view) * room);
+	char **names = (char **) malloc(sizeof(char *) * room);
+	if (!(views && names)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		char *p = line + strspn(line, " \t");
+		if ((*p == '#') || (*p == '\n') || !*p) continue;
+		if (n == room) {
+			room *= 2;
+			views = (batch_view *) realloc(views, sizeof(batch_view) * room);
+			names = (char **) realloc(names, sizeof(char *) * room);
+			if (!(views && names)) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(1);
+			}
+		}
+		batch_view *v = views + n;
+		if ((sscanf(p, "%lf %lf %lf %d %d %4095s", &x, &y, &scale, &v->width, &v->height, name) != 6)
+				|| (v->width < 1) || (v->height < 1) || !(scale > 0)) {
+			fprintf(stderr, "%s:%d: expected x y scale width height outfile\n", batchfile, lineno);
+			exit(1);
+		}
+		v->view.x = x;
+		v->view.y = y;
+		v->view.scale = scale;
+		v->data = (unsigned char *) malloc((long) MASK_STRIDE(v->width) * v->height);
+		names[n] = strdup(name);
+		if (!(v->data && names[n])) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		pixels += (long) v->width * v->height;
+		n++;
+	}
+	fclose(fp);
+
+	renderer *workers = create_pinned_renderer(num_threads);
+	printf("Rendering %d views, %ld pixels... ", n, pixels);
+	fflush(stdout);
+	START_TIMER
+	render_views(workers, sdf, n, views, precision);
+	PRINT_TIMER
+	printf("\n");
+	if (PROFILE) print_profile(workers);
+
+	for (int i = 0; i < n; i++) {
+		if (is_pbm(names[i])) write_pbm(names[i], views[i].data, views[i].width, views[i].height);
+		else write_mask_ppm(names[i], views[i].data, views[i].width, views[i].height);
+		free(views[i].data);
+		free(names[i]);
+	}
+	free_renderer(workers);
+	free(views);
+	free(names);
+	return 0;
+}
+
+
+// What report_pass needs to know
+typedef struct {
+	const char *outfile;
+	struct timespec start;
+} progress_state;
+
+
+/* Callback for render_progressive. Writes out the image after every pass, and says 
+ * how long it took to get that far, wall clock. */
+static int report_pass(const char *data, int width, int height, int step, void *user) {
+	progress_state *state = (progress_state *) user;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("Pass every %d pixels done after %.2f ms wall\n", step, 
+			((now.tv_sec - state->start.tv_sec) * 1000.0) + ((now.tv_nsec - state->start.tv_nsec) / 1000000.0));
+	write_image(state->outfile, data, width, height);
+	return 0;
+}
+
+
+/* Render the image. Compile time options in machine.h, and on the command line:
+ *   -f  the function to render (default FILENAME)
+ *   -o  where to put the image (default OUTFILE), a 1-bit pbm if it ends in .pbm
+ *   -s  width and height of the image in pixels (default IMAGE_SIZE)
+ *   -t  worker threads, 0 for none (default NUM_THREADS)
+ *   -b  compile the function to a tape in this file instead of rendering, -f loads those too
+ *   -j  evaluate pixels with native code from the JIT instead of the interpreter
+ *   -c  check the JIT against the interpreter on every pixel instead of rendering
+ *   -p  precision of the pixel evaluator: double (default), float or mixed
+ *   -d  also render in double precision, and report the pixels that came out different
+ *   -P  render progressively, writing out the image after every pass
+ *   -S  stream the image to the file a band at a time, instead of keeping all of it
+ *   -n  render with this many worker processes instead of threads
+ *   -l  be a render server listening on this socket, see server.c
+ *   -B  render every view listed in this file instead, see run_batch
+ *   -H  with PROFILE, write how long every tile took to this file as an image */
+int main(int argc, char** argv) {
+	struct timespec start_time, end_time;
+	int opcount, opt;
+	int use_jit = 0, compare = 0, diff = 0, progressive = 0, stream = 0, num_procs = 0;
+	int precision = PRECISION_DOUBLE;
+	const char *precision_names[] = {"double", "float", "mixed"};
+	const char *filename = FILENAME;
+	const char *outfile = OUTFILE;
+	const char *tapefile = (const char *)0;
+	const char *listen_path = (const char *)0;
+	const char *batchfile = (const char *)0;
+	const char *heatfile = (const char *)0;
+	int size = IMAGE_SIZE;
+	int num_threads = NUM_THREADS;
+
+	while ((opt = getopt(argc, argv, "f:o:s:t:b:jcp:dPSn:l:B:H:")) != -1) {
+		switch (opt) {
+			case 'f':
+				filename = optarg;
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			case 's':
+				size = atoi(optarg);
+				break;
+			case 't':
+				num_threads = atoi(optarg);
+				break;
+			case 'b':
+				tapefile = optarg;
+				break;
+			case 'j':
+				use_jit = 1;
+				break;
+			case 'c':
+				compare = 1;
+				break;
+			case 'p':
+				if (strcmp(optarg, "double") == 0) precision = PRECISION_DOUBLE;
+				else if (strcmp(optarg, "float") == 0) precision = PRECISION_FLOAT;
+				else if (strcmp(optarg, "mixed") == 0) precision = PRECISION_MIXED;
+				else {
+					fprintf(stderr, "Unknown precision: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'd':
+				diff = 1;
+				break;
+			case 'P':
+				progressive = 1;
+				break;
+			case 'S':
+				stream = 1;
+				break;
+			case 'n':
+				num_procs = atoi(optarg);
+				break;
+			case 'l':
+				listen_path = optarg;
+				break;
+			case 'B':
+				batchfile = optarg;
+				break;
+			case 'H':
+				heatfile = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-f file] [-o outfile] [-s size] [-t threads] [-b tapefile] [-j] [-c] [-p double|float|mixed] [-d] [-P] [-S] [-n procs] [-l socket] [-B batchfile] [-H heatmap]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if ((size < 1) || (num_threads < 0) || (num_procs < 0)) {
+		fprintf(stderr, "Size must be positive and threads and processes can't be negative.\n");
+		exit(1);
+	}
+	if (stream && (progressive || diff)) {
+		fprintf(stderr, "A streamed image is never all in memory, so -S doesn't go with -P or -d.\n");
+		exit(1);
+	}
+	if (use_jit && (precision != PRECISION_DOUBLE)) {
+		fprintf(stderr, "The JIT only does double precision, -j doesn't go with -p float or mixed.\n");
+		exit(1);
+	}
+	if (num_procs && (stream || progressive || use_jit || compare)) {
+		fprintf(stderr, "Worker processes run the interpreter a tile at a time, -n doesn't go with -S, -P, -j or -c.\n");
+		exit(1);
+	}
+
+	if (listen_path) return serve(listen_path, num_threads);
+
+	func *sdf = load_func(filename, 1);
+
+	if (tapefile) {
+		uint64_t source;
+		if (!hash_file(filename, &source)) {
+			fprintf(stderr, "Unable to read %s\n", filename);
+			exit(1);
+		}
+		if (!write_tape(tapefile, sdf, source)) {
+			fprintf(stderr, "Unable to write %s\n", tapefile);
+			exit(1);
+		}
+		printf("Wrote tape %s\n", tapefile);
+		free_func(sdf);
+		return 0;
+	}
+
+	if (use_jit || compare) {
+		START_TIMER
+		sdf->jit = jit_compile(sdf);
+		PRINT_TIMER
+		printf("\n");
+		if (!sdf->jit) {
+			fprintf(stderr, "JIT unavailable%s\n", compare ? "" : ", falling back to the interpreter.");
+			if (compare) exit(1);
+		}
+		if (!compare && !JIT_REACHES_PIXELS) {
+			printf("Note: tiles get their own short functions, the JIT only runs the full one.\n");
+		}
+	}
+
+	if (batchfile) {
+		run_batch(batchfile, sdf, num_threads, precision);
+		free_func(sdf);
+		return 0;
+	}
+
+	if (compare) {
+		fp_type* space = linspace(size);
+		printf("Comparing JIT and interpreter on %ld pixels... ", (long) size * size);
+		fflush(stdout);
+		opcount = compare_jit(sdf, space, size);
+		printf("%d mismatches\n", opcount);
+		free(space);
+		free_func(sdf);
+		return opcount ? 1 : 0;
+	}
+
+	// Unless it's needed a byte a pixel, the image is kept a bit a pixel.
+	int bits = !(progressive || diff);
+	long data_size = bits ? (long) MASK_STRIDE(size) * size : (long) size * size;
+
+	// Line the image up with the cache, so tiles on different threads share as little as possible.
+	char * data = (char *)0;
+	if (!stream && posix_memalign((void **) &data, 64, data_size)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+
+	// No threads to fork with the worker processes.
+	renderer *workers = create_pinned_renderer(num_procs ? 0 : num_threads);
+	viewport view = {0.0, 0.0, 1.0};
+
+	// Tile times only make sense for the one plain render of the whole image.
+	int across = (size + TILE_SIZE - 1) / TILE_SIZE;
+	if (heatfile && !PROFILE) printf("Note: -H needs PROFILE, see make profile.\n");
+	if (heatfile && PROFILE && !(stream || num_procs || progressive)) {
+		workers->heat = (float *) calloc((long) across * across, sizeof(float));
+		if (!workers->heat) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+	}
+
+	printf("Starting render in %s precision... ", precision_names[precision]);
+	if (num_procs) printf("spawning %d processes. ", num_procs);
+	else if (num_threads) printf("spawning %d threads. ", num_threads);
+	printf("\n");
+
+	START_TIMER
+	if (stream) {
+		if (!render_stream(workers, sdf, &view, size, size, precision, outfile, is_pbm(outfile))) exit(1);
+	} else if (num_procs) {
+		if (!render_distributed(sdf, &view, size, size, precision, num_procs, data, bits)) exit(1);
+	} else if (progressive) {
+		progress_state state;
+		state.outfile = outfile;
+		clock_gettime(CLOCK_MONOTONIC, &state.start);
+		render_progressive(workers, sdf, &view, size, size, precision, data, report_pass, &state);
+	} else if (bits) {
+		render_mask(workers, sdf, &view, size, size, precision, (unsigned char *) data);
+	} else {
+		render_view(workers, sdf, &view, size, size, precision, data);
+	}
+	PRINT_TIMER
+	printf("\n ");
+
+	if (PROFILE && !num_procs) print_profile(workers);
+	if (workers->heat) {
+		write_heatmap(heatfile, workers->heat, across, across);
+		free(workers->heat);
+		workers->heat = (float *)0;
+	}
+
+	if (diff) {
+		char * reference = (char *) malloc(data_size);
+		if (!reference) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		jit_code *jit = sdf->jit;
+		sdf->jit = (jit_code *)0;
+		render_view(workers, sdf, &view, size, size, PRECISION_DOUBLE, reference);
+		sdf->jit = jit;
+		printf("\nCompared to the double precision interpreter, ");
+		printf("%ld pixels differ\n", diff_images(reference, data, data_size, size));
+		free(reference);
+	}
+
+	if (!(progressive || stream)) {
+		if (!bits) write_image(outfile, data, size, size);
+		else if (is_pbm(outfile)) write_pbm(outfile, (unsigned char *) data, size, size);
+		else write_mask_ppm(outfile, (unsigned char *) data, size, size);
+	}
+
+	free_renderer(workers);
+	free(data);
+	free_func(sdf);
+	return 0;
+}
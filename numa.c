@@ -0,0 +1,228 @@
+/*
+ * numa.c
+ *
+ * Where the workers run and where their memory lives. On a machine with more than one
+ * NUMA node, a thread the scheduler moves to the other socket leaves its scratch
+ * behind, and every block it renders after that goes across the interconnect. So the
+ * workers get pinned, a CPU each, in an order that fills one node before the next.
+ * Scratch comes out of an arena that's mapped but not touched until the worker itself
+ * uses it, which is what puts the pages on the worker's own node, and big arenas get
+ * huge pages to go easier on the TLB. Each node also gets its own copy of the tape.
+ * Nothing here is any use on one node, but nothing here costs anything there either.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#define _GNU_SOURCE
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// A CPU we're allowed to run on, and what's needed to put it in order
+typedef struct {
+	int cpu;
+	int node;
+	int sibling;	// 0 for the first hyperthread of a core, 1 for the rest
+	int rank;	// place among the CPUs of its node
+} cpu_info;
+
+
+/* The first number in a sysfs list like "0-3,8-11", or -1 if there isn't one. */
+static int first_in_list(const char *path) {
+	int first = -1;
+	FILE *fp = fopen(path, "r");
+	if (!fp) return -1;
+	if (fscanf(fp, "%d", &first) != 1) first = -1;
+	fclose(fp);
+	return first;
+}
+
+
+/* Which node cpu is on. Without sysfs to say, everything is node 0. */
+static int node_of(int cpu) {
+	char path[128];
+	for (int node = 0; node < MAX_NODES; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if (access(path, F_OK) == 0) return node;
+	}
+	return 0;
+}
+
+
+static int compare_compact(const void *a, const void *b) {
+	const cpu_info *p = (const cpu_info *) a, *q = (const cpu_info *) b;
+	if (p->node != q->node) return p->node - q->node;
+	if (p->sibling != q->sibling) return p->sibling - q->sibling;
+	return p->cpu - q->cpu;
+}
+
+
+static int compare_spread(const void *a, const void *b) {
+	const cpu_info *p = (const cpu_info *) a, *q = (const cpu_info *) b;
+	if (p->rank != q->rank) return p->rank - q->rank;
+	return p->node - q->node;
+}
+
+
+/* The CPUs this process may run on, in the order to pin workers to them: node by node,
+ * and within a node, one hyperthread of every core before any of their siblings. With
+ * PIN_SPREAD, the first of every node, then the second of every node, and so on.
+ * Fills in up to max CPUs and the node each is on, and returns how many. */
+int cpu_order(int *cpus, int *nodes, int max) {
+	cpu_set_t allowed;
+	char path[128];
+	int i, n = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+	cpu_info *info = (cpu_info *) malloc(sizeof(cpu_info) * CPU_SETSIZE);
+	if (!info) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &allowed)) continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", i);
+		int first = first_in_list(path);
+		info[n].cpu = i;
+		info[n].node = node_of(i);
+		info[n].sibling = (first >= 0) && (first != i);
+		n++;
+	}
+
+	qsort(info, n, sizeof(cpu_info), compare_compact);
+	if (PIN_SPREAD) {
+		for (i = 0; i < n; i++) info[i].rank = (i && (info[i].node == info[i - 1].node)) ? info[i - 1].rank + 1 : 0;
+		qsort(info, n, sizeof(cpu_info), compare_spread);
+	}
+	if (n > max) n = max;
+	for (i = 0; i < n; i++) {
+		cpus[i] = info[i].cpu;
+		nodes[i] = info[i].node;
+	}
+	free(info);
+	return n;
+}
+
+
+/* Keep the calling thread on cpu. It's only a hint, so if it doesn't take, never mind. */
+void pin_thread(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+
+/* Map size bytes of zeros for a scratchpad, page aligned, so aligned to the cache line
+ * and anything SIMD wants too. None of it is touched here: the pages go on the node of
+ * whichever thread writes them first, and that should be the one that renders with
+ * them. With SCRATCH_HUGE_PAGES, anything as big as a huge page gets them, if the
+ * kernel has any. Sets mapped to how much was really mapped, for arena_free. */
+void *arena_alloc(size_t size, size_t *mapped) {
+	long page = sysconf(_SC_PAGESIZE);
+	size_t huge = HUGE_PAGE_SIZE;
+	char *p = (char *) MAP_FAILED;
+
+	if (!size) size = 1;
+	if ((SCRATCH_HUGE_PAGES == 2) && (size >= huge)) {
+		*mapped = (size + huge - 1) & ~(huge - 1);
+		p = (char *) mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if ((p == (char *) MAP_FAILED) && SCRATCH_HUGE_PAGES && (size >= huge)) {
+		// Transparent huge pages have to be lined up on one, so map a spare and trim.
+		*mapped = (size + huge - 1) & ~(huge - 1);
+		char *wide = (char *) mmap(NULL, *mapped + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (wide != (char *) MAP_FAILED) {
+			p = (char *) (((uintptr_t) wide + huge - 1) & ~((uintptr_t) huge - 1));
+			if (p > wide) munmap(wide, p - wide);
+			munmap(p + *mapped, (wide + huge) - p);
+			madvise(p, *mapped, MADV_HUGEPAGE);
+		}
+	}
+	if (p == (char *) MAP_FAILED) {
+		*mapped = (size + page - 1) & ~((size_t) page - 1);
+		p = (char *) mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (p == (char *) MAP_FAILED) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	return p;
+}
+
+
+void arena_free(void *arena, size_t mapped) {
+	if (arena) munmap(arena, mapped);
+}
+
+
+/* The copy of sdf for node to render the job of generation with. The first worker of
+ * the node to get here makes it, so it's that worker's node the pages land on, and the
+ * rest of them wait the few microseconds that takes. A job rendering the same tape as
+ * the last one, which is nearly all of them, keeps the copy it has: checking costs a
+ * memcmp, copying costs a pack_func and a separate_func. The JIT's code is shared, it's
+ * read only and small enough for every node to have in cache. The sorted copy isn't,
+ * every tile starts from it. */
+func *node_func(renderer *r, int node, const func *sdf, int generation) {
+	node_tape *copy = r->tapes + node;
+	pthread_mutex_lock(&copy->lock);
+	if (copy->generation == generation) {
+		pthread_mutex_unlock(&copy->lock);
+		return &copy->tape;
+	}
+	// Same size and the same instructions, packed and sorted the same way if at all.
+	int same = copy->tape.func && (copy->tape.size == sdf->size) && (copy->tape.slots == sdf->slots)
+		&& (!copy->tape.packed == !sdf->packed) && (!copy->tape.sorted == !sdf->sorted)
+		&& !memcmp(copy->tape.func, sdf->func, sizeof(operation) * sdf->size);
+	if (same) {
+		copy->tape.jit = sdf->jit;
+	} else {
+		free(copy->tape.func);
+		free(copy->tape.packed);
+		free(copy->tape.pool);
+		if (copy->tape.sorted) {
+			free(copy->tape.sorted->func);
+			free(copy->tape.sorted);
+		}
+		copy->tape = *sdf;
+		copy->tape.func = (operation *) malloc(sizeof(operation) * sdf->size);
+		if (!copy->tape.func) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		memcpy(copy->tape.func, sdf->func, sizeof(operation) * sdf->size);
+		copy->tape.packed = (packed_op *)0;
+		copy->tape.pool = (fp_type *)0;
+		copy->tape.mapping = (void *)0;
+		copy->tape.mapsize = 0;
+		if (sdf->packed) pack_func(&copy->tape);
+		if (sdf->sorted) separate_func(&copy->tape);
+	}
+	copy->generation = generation;
+	pthread_mutex_unlock(&copy->lock);
+	return &copy->tape;
+}
+
+
+/* Free the renderer's copies of the tape, and what holds them. */
+void free_node_tapes(renderer *r) {
+	if (!r->tapes) return;
+	for (int i = 0; i < r->num_nodes; i++) {
+		free(r->tapes[i].tape.func);
+		free(r->tapes[i].tape.packed);
+		free(r->tapes[i].tape.pool);
+		if (r->tapes[i].tape.sorted) {
+			free(r->tapes[i].tape.sorted->func);
+			free(r->tapes[i].tape.sorted);
+		}
+		pthread_mutex_destroy(&r->tapes[i].lock);
+	}
+	free(r->tapes);
+	r->tapes = (node_tape *)0;
+}
@@ -0,0 +1,514 @@
+/*
+ * optimize.c
+ *
+ * Makes the function shorter before anything runs it, since every instruction that
+ * goes away here goes away for every pixel. One pass forward through the tape folds
+ * constants, applies a few algebraic rewrites and merges instructions that compute
+ * the same thing, then one pass back from the output drops anything it doesn't need.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+// How many times to go round again when a pass still finds something to do
+#define OPTIMIZE_ROUNDS 4
+
+
+/* How many operands an instruction with code reads. */
+int arity(enum opcode code) {
+	switch (code) {
+		case VAR_X:
+		case VAR_Y:
+		case CONST:
+			return 0;
+		case NEG:
+		case SQUARE:
+		case SQRT:
+		case ADD_IMM:
+		case SUB_IMM:
+		case IMM_SUB:
+		case MUL_IMM:
+		case MAX_IMM:
+		case MIN_IMM:
+			return 1;
+		default:
+			return 2;
+	}
+}
+
+
+/* Operands name lines, the passes want tape indexes. Needs every line assigned once. */
+static void to_indexes(func *sdf) {
+	int *producer = (int *) malloc(sizeof(int) * sdf->slots);
+	if (!producer) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (int i = 0; i < sdf->size; i++) {
+		operation *op = sdf->func + i;
+		int n = arity(op->code);
+		if (n >= 1) op->a = producer[op->a];
+		if (n == 2) op->b = producer[op->b];
+		producer[op->line] = i;
+	}
+	free(producer);
+}
+
+
+/* Everything that makes two operations compute the same thing. */
+static uint64_t op_hash(const operation *op) {
+	uint64_t h = (uint64_t) op->code * 0x9e3779b97f4a7c15ULL;
+	if (op->code == CONST) {
+		uint64_t bits = 0;
+		memcpy(&bits, &op->value, sizeof(op->value));
+		h ^= bits;
+	} else {
+		h ^= ((uint64_t) (uint32_t) op->a << 32) | (uint32_t) op->b;
+	}
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return h ^ (h >> 32);
+}
+
+
+static int op_equal(const operation *x, const operation *y) {
+	if (x->code != y->code) return 0;
+	if (x->code == CONST) return memcmp(&x->value, &y->value, sizeof(x->value)) == 0;
+	return (x->a == y->a) && (x->b == y->b);
+}
+
+
+static int is_const(const operation *ops, int i, fp_type value) {
+	return (ops[i].code == CONST) && (memcmp(&ops[i].value, &value, sizeof(value)) == 0);
+}
+
+
+/* Work out op if all its operands are constants. Returns 1 if it did. */
+static int fold(operation *ops, operation *op) {
+	int n = arity(op->code);
+	if (n == 0) return 0;
+	if (ops[op->a].code != CONST) return 0;
+	if ((n == 2) && (ops[op->b].code != CONST)) return 0;
+
+	fp_type a = ops[op->a].value;
+	fp_type b = (n == 2) ? ops[op->b].value : 0.0;
+	fp_type r = 0.0;
+	switch (op->code) {
+		case NEG: r = -a; break;
+		case SQUARE: r = a * a; break;
+		case SQRT: r = sqrt_fp(a); break;
+		case ADD: r = a + b; break;
+		case SUB: r = a - b; break;
+		case MUL: r = a * b; break;
+		case MAX: r = fmax_fp(a, b); break;
+		case MIN: r = fmin_fp(a, b); break;
+		default: return 0;
+	}
+	op->code = CONST;
+	op->value = r;
+	return 1;
+}
+
+
+/* Algebraic rewrites. Either changes op in place and returns -1, or finds that op is
+ * just some earlier operation and returns its index, or returns -2 for no change.
+ * All of these give exactly the same bits as the original, except square of sqrt, which
+ * can be one rounding off, and only happens where x is known not to be negative. */
+static int rewrite(operation *ops, const char *nonneg, operation *op) {
+	int a = op->a, b = op->b;
+	switch (op->code) {
+		case NEG:
+			if (ops[a].code == NEG) return ops[a].a;
+			break;
+		case SQUARE:
+			if (ops[a].code == NEG) {
+				op->a = ops[a].a;
+				return -1;
+			}
+			if ((ops[a].code == SQRT) && nonneg[ops[a].a]) return ops[a].a;
+			break;
+		case ADD:
+			// x + (-y) is x - y, and the other way round. x + -0 is x, even for x = -0.
+			if (ops[b].code == NEG) {
+				op->code = SUB;
+				op->b = ops[b].a;
+				return -1;
+			}
+			if (ops[a].code == NEG) {
+				op->code = SUB;
+				op->a = b;
+				op->b = ops[a].a;
+				return -1;
+			}
+			if (is_const(ops, b, -0.0)) return a;
+			if (is_const(ops, a, -0.0)) return b;
+			break;
+		case SUB:
+			if (ops[b].code == NEG) {
+				op->code = ADD;
+				op->b = ops[b].a;
+				return -1;
+			}
+			if (is_const(ops, b, 0.0)) return a;
+			break;
+		case MUL:
+			if (is_const(ops, b, 1.0)) return a;
+			if (is_const(ops, a, 1.0)) return b;
+			if (is_const(ops, b, -1.0)) {
+				op->code = NEG;
+				return -1;
+			}
+			if (is_const(ops, a, -1.0)) {
+				op->code = NEG;
+				op->a = b;
+				return -1;
+			}
+			if (a == b) {
+				op->code = SQUARE;
+				return -1;
+			}
+			break;
+		case MAX:
+		case MIN:
+			if (a == b) return a;
+			break;
+		default:
+			break;
+	}
+	return -2;
+}
+
+
+/* Whether op can be shown never to come out negative. */
+static int never_negative(const operation *ops, const char *nonneg, const operation *op) {
+	switch (op->code) {
+		case CONST:
+			return op->value >= 0.0;
+		case SQUARE:
+			return 1;
+		case SQRT:
+			return nonneg[op->a];
+		case ADD:
+		case MUL:
+		case MIN:
+			return nonneg[op->a] && nonneg[op->b];
+		case MAX:
+			return nonneg[op->a] || nonneg[op->b];
+		default:
+			return 0;
+	}
+}
+
+
+/* One forward pass and one backward pass over the tape, operands are indexes into
+ * the tape on the way in and out. Returns 1 if anything changed. */
+static int optimize_pass(func *sdf, optimize_stats *stats) {
+	int size = sdf->size;
+	operation *ops = sdf->func;
+	int tsize = 1, i, j, k;
+	while (tsize < size * 2) tsize *= 2;
+	int *rep = (int *) malloc(sizeof(int) * size);
+	int *table = (int *) malloc(sizeof(int) * tsize);
+	char *nonneg = (char *) malloc(size);
+	char *live = (char *) malloc(size);
+	if (!(rep && table && nonneg && live)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (i = 0; i < tsize; i++) table[i] = -1;
+	int changed = 0;
+
+	for (i = 0; i < size; i++) {
+		operation *op = ops + i;
+		int n = arity(op->code);
+		if (n >= 1) op->a = rep[op->a];
+		if (n == 2) op->b = rep[op->b];
+		rep[i] = i;
+
+		// Rewrite until nothing more applies, which never takes long.
+		for (int tries = 0; tries < 8; tries++) {
+			if (fold(ops, op)) {
+				stats->folded++;
+				changed = 1;
+				break;
+			}
+			int r = rewrite(ops, nonneg, op);
+			if (r == -2) break;
+			stats->rewritten++;
+			changed = 1;
+			if (r >= 0) {
+				rep[i] = r;
+				break;
+			}
+		}
+		if (rep[i] != i) continue;
+
+		// The operands of ADD and MUL can go either way round.
+		if (((op->code == ADD) || (op->code == MUL)) && (op->a > op->b)) {
+			int t = op->a;
+			op->a = op->b;
+			op->b = t;
+		}
+		if (op->code != CONST) {
+			if (n < 2) op->b = 0;
+			if (n < 1) op->a = 0;
+		}
+
+		for (j = op_hash(op) & (tsize - 1); table[j] >= 0; j = (j + 1) & (tsize - 1)) {
+			if (op_equal(ops + table[j], op)) break;
+		}
+		if (table[j] >= 0) {
+			rep[i] = table[j];
+			stats->merged++;
+			changed = 1;
+			continue;
+		}
+		table[j] = i;
+		nonneg[i] = never_negative(ops, nonneg, op);
+	}
+
+	// Back from the output, keeping only what it needs.
+	memset(live, 0, size);
+	int out = rep[size - 1];
+	live[out] = 1;
+	for (i = out; i >= 0; i--) {
+		if (!live[i]) continue;
+		int n = arity(ops[i].code);
+		if (n >= 1) live[ops[i].a] = 1;
+		if (n == 2) live[ops[i].b] = 1;
+	}
+
+	for (i = 0; i < size; i++) {
+		if ((rep[i] == i) && !live[i]) stats->dead++;
+	}
+
+	// Squeeze out everything that isn't live, and renumber.
+	for (i = 0, k = 0; i <= out; i++) {
+		if (!live[i]) continue;
+		operation op = ops[i];
+		int n = arity(op.code);
+		if (n >= 1) op.a = rep[op.a];
+		if (n == 2) op.b = rep[op.b];
+		op.line = k;
+		ops[k] = op;
+		rep[i] = k++;
+	}
+	if (k != size) changed = 1;
+	sdf->size = k;
+
+	free(rep);
+	free(table);
+	free(nonneg);
+	free(live);
+	return changed;
+}
+
+
+/* Optimize the function in place. It has to be straight from parse_file, with every
+ * line number assigned once, so this goes before allocate_registers. Afterwards line
+ * numbers run 0, 1, 2... in order, and there is one slot per instruction.
+ * Returns the number of instructions removed. */
+int optimize(func *sdf, optimize_stats *stats) {
+	int before = sdf->size;
+	memset(stats, 0, sizeof(optimize_stats));
+	to_indexes(sdf);
+
+	for (int round = 0; round < OPTIMIZE_ROUNDS; round++) {
+		if (!optimize_pass(sdf, stats)) break;
+	}
+	sdf->slots = sdf->size;
+	return before - sdf->size;
+}
+
+
+/* Drop whatever nobody reads, working back so the chains go all at once, then close 
+ * up the gaps. uses holds the count of readers of every instruction on the tape. 
+ * Returns the new size. */
+static int sweep(func *sdf, int *uses) {
+	int size = sdf->size;
+	operation *ops = sdf->func;
+	int *newindex = (int *) malloc(sizeof(int) * size);
+	if (!newindex) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	int i, k;
+
+	for (i = size - 1; i >= 0; i--) {
+		if (uses[i]) continue;
+		int n = arity(ops[i].code);
+		if (n >= 1) uses[ops[i].a]--;
+		if (n == 2) uses[ops[i].b]--;
+	}
+	for (i = 0, k = 0; i < size; i++) {
+		if (!uses[i]) continue;
+		operation op = ops[i];
+		int n = arity(op.code);
+		if (n >= 1) op.a = newindex[op.a];
+		if (n == 2) op.b = newindex[op.b];
+		op.line = k;
+		ops[k] = op;
+		newindex[i] = k++;
+	}
+	sdf->size = k;
+	sdf->slots = k;
+
+	free(newindex);
+	return k;
+}
+
+
+/* Swap common chains of instructions for single instructions that do the lot:
+ *   sqrt(square(a) + square(b))  becomes  HYPOT a b
+ *   max(a, neg(b))               becomes  MAX_NEG a b
+ *   min(a, neg(b))               becomes  MIN_NEG a b
+ * An inner instruction is only folded in if nothing else reads it, otherwise it would 
+ * be worked out twice. The fused instructions round exactly like the chains they 
+ * replace. Same rules as optimize for what the function has to look like going in, and 
+ * it comes out the same way.
+ * Returns the number of instructions removed. */
+int fuse(func *sdf, fuse_stats *stats) {
+	int size = sdf->size;
+	operation *ops = sdf->func;
+	int *uses = (int *) calloc(size, sizeof(int));
+	if (!uses) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	int i, k;
+	memset(stats, 0, sizeof(fuse_stats));
+	to_indexes(sdf);
+
+	for (i = 0; i < size; i++) {
+		int n = arity(ops[i].code);
+		if (n >= 1) uses[ops[i].a]++;
+		if (n == 2) uses[ops[i].b]++;
+	}
+	uses[size - 1]++;	// The output is always wanted.
+
+	for (i = 0; i < size; i++) {
+		operation *op = ops + i;
+		if (op->code == SQRT) {
+			int sum = op->a;
+			if ((ops[sum].code != ADD) || (uses[sum] != 1)) continue;
+			int sa = ops[sum].a, sb = ops[sum].b;
+			if ((ops[sa].code != SQUARE) || (ops[sb].code != SQUARE)) continue;
+			op->code = HYPOT;
+			op->a = ops[sa].a;
+			op->b = ops[sb].a;
+			uses[sum]--;	// sweep lets go of the squares when it drops the sum.
+			uses[op->a]++;
+			uses[op->b]++;
+			stats->hypot++;
+		} else if ((op->code == MAX) || (op->code == MIN)) {
+			int other, neg;
+			if ((ops[op->b].code == NEG) && (uses[op->b] == 1)) {
+				other = op->a;
+				neg = op->b;
+			} else if ((ops[op->a].code == NEG) && (uses[op->a] == 1)) {
+				other = op->b;
+				neg = op->a;
+			} else {
+				continue;
+			}
+			if (op->code == MAX) stats->max_neg++;
+			else stats->min_neg++;
+			op->code = (op->code == MAX) ? MAX_NEG : MIN_NEG;
+			op->a = other;
+			op->b = ops[neg].a;
+			uses[neg]--;
+			uses[op->b]++;
+		}
+	}
+
+	k = sweep(sdf, uses);
+	free(uses);
+	return size - k;
+}
+
+
+/* Give every instruction that reads a constant the number itself, so it doesn't have 
+ * to go and get it from scratch:
+ *   a + c, c + a  becomes  ADD_IMM a c        a - c  becomes  SUB_IMM a c
+ *   a * c, c * a  becomes  MUL_IMM a c        c - a  becomes  IMM_SUB a c
+ *   max(a, c)     becomes  MAX_IMM a c        max(a, -c)  becomes  MAX_IMM a -c
+ * and the same for min. The CONST instructions are dropped once nothing reads them. 
+ * The evaluators never touch one again, and the JIT puts the numbers in its constant 
+ * pool. Any constant still read by something without an immediate form (the odd 
+ * square of a number, with OPTIMIZE off) stays as a CONST, and gets done every time. 
+ * Same rules as optimize for what the function has to look like going in, and it 
+ * comes out the same way.
+ * Returns the number of instructions removed. */
+int lower_immediates(func *sdf) {
+	int size = sdf->size;
+	operation *ops = sdf->func;
+	int *uses = (int *) calloc(size, sizeof(int));
+	if (!uses) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	int i, k;
+	to_indexes(sdf);
+
+	for (i = 0; i < size; i++) {
+		int n = arity(ops[i].code);
+		if (n >= 1) uses[ops[i].a]++;
+		if (n == 2) uses[ops[i].b]++;
+	}
+	uses[size - 1]++;	// The output is always wanted.
+
+	for (i = 0; i < size; i++) {
+		operation *op = ops + i;
+		int ca, cb, imm;
+		if (arity(op->code) != 2) continue;
+		ca = (ops[op->a].code == CONST);
+		cb = (ops[op->b].code == CONST);
+		if (!(ca || cb)) continue;
+		// With both constant (only without OPTIMIZE), b goes inline and a stays put.
+		imm = cb ? op->b : op->a;
+		switch (op->code) {
+			case ADD:
+				op->code = ADD_IMM;
+				break;
+			case MUL:
+				op->code = MUL_IMM;
+				break;
+			case MAX:
+				op->code = MAX_IMM;
+				break;
+			case MIN:
+				op->code = MIN_IMM;
+				break;
+			case SUB:
+				op->code = cb ? SUB_IMM : IMM_SUB;
+				break;
+			case MAX_NEG:
+			case MIN_NEG:
+				// Only a constant b can go, and it goes in negated.
+				if (!cb) continue;
+				op->code = (op->code == MAX_NEG) ? MAX_IMM : MIN_IMM;
+				uses[imm]--;
+				op->b = 0;
+				op->value = -ops[imm].value;
+				continue;
+			default:
+				continue;
+		}
+		uses[imm]--;
+		if (imm == op->a) op->a = op->b;
+		op->b = 0;
+		op->value = ops[imm].value;
+	}
+
+	k = sweep(sdf, uses);
+	free(uses);
+	return size - k;
+}
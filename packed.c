@@ -0,0 +1,246 @@
+/*
+ * packed.c
+ *
+ * A smaller tape for the interpreter. An operation is 24 bytes, mostly a double that
+ * only constants need, so walking the tape drags in three times the memory it uses.
+ * Here every instruction is 8 bytes, with the numbers moved out to a pool of their
+ * own, and the evaluators jump straight from the end of one instruction to the code
+ * for the next with computed goto, so every opcode has a branch of its own to predict
+ * instead of sharing the one at the top of a switch.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+
+/* Make the packed copy of sdf, if it fits. Returns 1 if it did. */
+int pack_func(func *sdf) {
+	int i, entries = 0;
+	sdf->packed = (packed_op *)0;
+	sdf->pool = (fp_type *)0;
+	if (sdf->slots > PACKED_MAX + 1) return 0;
+	for (i = 0; i < sdf->size; i++) {
+		if ((sdf->func[i].code == CONST) || (sdf->func[i].code >= ADD_IMM)) entries++;
+	}
+	if (entries > PACKED_MAX + 1) return 0;
+
+	sdf->packed = (packed_op *) malloc(sizeof(packed_op) * (sdf->size + 1));
+	sdf->pool = (fp_type *) malloc(sizeof(fp_type) * (entries + 1));
+	if (!(sdf->packed && sdf->pool)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+
+	entries = 0;
+	for (i = 0; i < sdf->size; i++) {
+		operation *oper = sdf->func + i;
+		packed_op *op = sdf->packed + i;
+		op->code = oper->code;
+		op->unused = 0;
+		op->line = oper->line;
+		op->a = oper->a;
+		op->b = oper->b;
+		if ((oper->code == CONST) || (oper->code >= ADD_IMM)) {
+			sdf->pool[entries] = oper->value;
+			op->b = entries++;
+		}
+	}
+	sdf->packed[sdf->size].code = PACKED_END;
+	return 1;
+}
+
+
+/* render_block for the packed copy. Same rules for memory, x, y and out. */
+int render_packed(func *sdf, fp_type *memory, const fp_type *x, const fp_type *y, fp_type *out) {
+	static void *dispatch[] = {
+		[VAR_X] = &&var_x, [VAR_Y] = &&var_y, [CONST] = &&constant,
+		[ADD] = &&add, [SUB] = &&sub, [MUL] = &&mul, [MAX] = &&max, [MIN] = &&min,
+		[NEG] = &&neg, [SQUARE] = &&square, [SQRT] = &&sqrt,
+		[HYPOT] = &&hypot, [MAX_NEG] = &&max_neg, [MIN_NEG] = &&min_neg,
+		[ADD_IMM] = &&add_imm, [SUB_IMM] = &&sub_imm, [IMM_SUB] = &&imm_sub,
+		[MUL_IMM] = &&mul_imm, [MAX_IMM] = &&max_imm, [MIN_IMM] = &&min_imm,
+		[PACKED_END] = &&end
+	};
+	const packed_op *op = sdf->packed;
+	const fp_type *pool = sdf->pool;
+	fp_type *dst, *a, *b, imm;
+	int j;
+
+// Every handler ends by jumping to the next one.
+#define NEXT op++; goto *dispatch[op->code];
+#define DST dst = memory + (op->line * BLOCK_SIZE);
+#define A a = memory + (op->a * BLOCK_SIZE);
+#define B b = memory + (op->b * BLOCK_SIZE);
+
+	goto *dispatch[op->code];
+
+var_x:
+	DST for (j = 0; j < BLOCK_SIZE; j++) dst[j] = x[j];
+	NEXT
+var_y:
+	DST for (j = 0; j < BLOCK_SIZE; j++) dst[j] = y[j];
+	NEXT
+constant:
+	DST imm = pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = imm;
+	NEXT
+add:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] + b[j];
+	NEXT
+sub:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] - b[j];
+	NEXT
+mul:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * b[j];
+	NEXT
+max:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmax_fp(a[j], b[j]);
+	NEXT
+min:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmin_fp(a[j], b[j]);
+	NEXT
+neg:
+	DST A for (j = 0; j < BLOCK_SIZE; j++) dst[j] = -a[j];
+	NEXT
+square:
+	DST A for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * a[j];
+	NEXT
+sqrt:
+	DST A for (j = 0; j < BLOCK_SIZE; j++) dst[j] = sqrt_fp(a[j]);
+	NEXT
+hypot:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = sqrt_fp((a[j] * a[j]) + (b[j] * b[j]));
+	NEXT
+max_neg:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmax_fp(a[j], -b[j]);
+	NEXT
+min_neg:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmin_fp(a[j], -b[j]);
+	NEXT
+add_imm:
+	DST A imm = pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] + imm;
+	NEXT
+sub_imm:
+	DST A imm = pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] - imm;
+	NEXT
+imm_sub:
+	DST A imm = pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = imm - a[j];
+	NEXT
+mul_imm:
+	DST A imm = pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * imm;
+	NEXT
+max_imm:
+	DST A imm = pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmax_fp(a[j], imm);
+	NEXT
+min_imm:
+	DST A imm = pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmin_fp(a[j], imm);
+	NEXT
+end:
+	dst = memory + (op[-1].line * BLOCK_SIZE);
+	for (j = 0; j < BLOCK_SIZE; j++) out[j] = dst[j];
+	return 0;
+}
+
+
+/* render_block_float for the packed copy. */
+int render_packed_float(func *sdf, float *memory, const float *x, const float *y, float *out) {
+	static void *dispatch[] = {
+		[VAR_X] = &&var_x, [VAR_Y] = &&var_y, [CONST] = &&constant,
+		[ADD] = &&add, [SUB] = &&sub, [MUL] = &&mul, [MAX] = &&max, [MIN] = &&min,
+		[NEG] = &&neg, [SQUARE] = &&square, [SQRT] = &&sqrt,
+		[HYPOT] = &&hypot, [MAX_NEG] = &&max_neg, [MIN_NEG] = &&min_neg,
+		[ADD_IMM] = &&add_imm, [SUB_IMM] = &&sub_imm, [IMM_SUB] = &&imm_sub,
+		[MUL_IMM] = &&mul_imm, [MAX_IMM] = &&max_imm, [MIN_IMM] = &&min_imm,
+		[PACKED_END] = &&end
+	};
+	const packed_op *op = sdf->packed;
+	const fp_type *pool = sdf->pool;
+	float *dst, *a, *b, imm;
+	int j;
+
+	goto *dispatch[op->code];
+
+var_x:
+	DST for (j = 0; j < BLOCK_SIZE; j++) dst[j] = x[j];
+	NEXT
+var_y:
+	DST for (j = 0; j < BLOCK_SIZE; j++) dst[j] = y[j];
+	NEXT
+constant:
+	DST imm = (float) pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = imm;
+	NEXT
+add:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] + b[j];
+	NEXT
+sub:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] - b[j];
+	NEXT
+mul:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * b[j];
+	NEXT
+max:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmaxf(a[j], b[j]);
+	NEXT
+min:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fminf(a[j], b[j]);
+	NEXT
+neg:
+	DST A for (j = 0; j < BLOCK_SIZE; j++) dst[j] = -a[j];
+	NEXT
+square:
+	DST A for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * a[j];
+	NEXT
+sqrt:
+	DST A for (j = 0; j < BLOCK_SIZE; j++) dst[j] = sqrtf(a[j]);
+	NEXT
+hypot:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = sqrtf((a[j] * a[j]) + (b[j] * b[j]));
+	NEXT
+max_neg:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmaxf(a[j], -b[j]);
+	NEXT
+min_neg:
+	DST A B for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fminf(a[j], -b[j]);
+	NEXT
+add_imm:
+	DST A imm = (float) pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] + imm;
+	NEXT
+sub_imm:
+	DST A imm = (float) pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] - imm;
+	NEXT
+imm_sub:
+	DST A imm = (float) pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = imm - a[j];
+	NEXT
+mul_imm:
+	DST A imm = (float) pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = a[j] * imm;
+	NEXT
+max_imm:
+	DST A imm = (float) pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fmaxf(a[j], imm);
+	NEXT
+min_imm:
+	DST A imm = (float) pool[op->b];
+	for (j = 0; j < BLOCK_SIZE; j++) dst[j] = fminf(a[j], imm);
+	NEXT
+end:
+	dst = memory + (op[-1].line * BLOCK_SIZE);
+	for (j = 0; j < BLOCK_SIZE; j++) out[j] = dst[j];
+	return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * parse.c
+ *
+ * Reads Prospero Challenge tapes. The file is mapped into memory and scanned once,
+ * with no copying into line buffers and no scanf, since a tape with a few million
+ * instructions would otherwise take longer to load than to render. Big files are
+ * cut up at newlines and parsed on several threads at once.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// One thread's share of the file, always starting at the beginning of a line.
+typedef struct {
+	const char *filename;
+	const char *file;	// the whole file, for working out line numbers in errors
+	const char *start;
+	const char *end;
+	operation *ops;
+	int size;
+	int capacity;
+	int slots;
+	jmp_buf bail;	// where parse_error goes back to
+	char error[PARSE_ERROR_SIZE];	// what went wrong, empty if nothing did
+} parse_chunk;
+
+// Powers of ten that are exact in fp_type
+static const fp_type pow10_exact[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+/* Put message in error, with the file name, number and text of the line at in the file 
+ * ending by end. Line numbers are only worked out here, so the happy path never has to 
+ * count newlines. */
+static void describe_line(char *error, int errsize, const char *filename, const char *file, const char *end, 
+		const char *at, const char *message) {
+	int line = 1;
+	const char *p, *eol;
+	for (p = file; p < at; p++) {
+		if (*p == '\n') line++;
+	}
+	for (p = at; (p > file) && (p[-1] != '\n'); p--);
+	for (eol = p; (eol < end) && (*eol != '\n'); eol++);
+	snprintf(error, errsize, "%s:%d: %s: %.*s", filename, line, message, (int) (eol - p), p);
+}
+
+
+/* Write down what's wrong with the line at in the file, and give up on the chunk. */
+static void parse_error(parse_chunk *chunk, const char *at, const char *message) {
+	describe_line(chunk->error, sizeof(chunk->error), chunk->filename, chunk->file, chunk->end, at, message);
+	longjmp(chunk->bail, 1);
+}
+
+
+static const char *skip_spaces(const char *p, const char *end) {
+	while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r'))) p++;
+	return p;
+}
+
+
+/* Read an operand name, an underscore and some hex digits. */
+static const char *parse_id(parse_chunk *chunk, const char *p, int *out) {
+	const char *end = chunk->end;
+	unsigned int value = 0;
+	const char *digits;
+
+	p = skip_spaces(p, end);
+	if ((p == end) || (*p != '_')) parse_error(chunk, p, "expected _ and a hex number");
+	digits = ++p;
+	while (p < end) {
+		char c = *p;
+		if ((c >= '0') && (c <= '9')) value = (value << 4) | (c - '0');
+		else if ((c >= 'a') && (c <= 'f')) value = (value << 4) | (c - 'a' + 10);
+		else if ((c >= 'A') && (c <= 'F')) value = (value << 4) | (c - 'A' + 10);
+		else break;
+		if (value > PARSE_MAX_NAME) parse_error(chunk, digits, "name out of range");
+		p++;
+	}
+	if (p == digits) parse_error(chunk, p, "expected hex digits");
+	*out = (int) value;
+	return p;
+}
+
+
+/* Read a decimal number. Up to 19 digits of mantissa and a small enough exponent come
+ * out exactly right from one multiply or divide, which is everything in prospero.vm.
+ * Anything fancier goes to strto_fp, so the result always matches it bit for bit. */
+static const char *parse_number(parse_chunk *chunk, const char *p, fp_type *out) {
+	const char *end = chunk->end;
+	const char *start, *q;
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0, negative = 0, expsign = 1, e = 0, inexact = 0;
+
+	p = skip_spaces(p, end);
+	start = p;
+	if ((p < end) && ((*p == '-') || (*p == '+'))) negative = (*p++ == '-');
+	for (q = p; (q < end) && (*q >= '0') && (*q <= '9'); q++) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*q - '0');
+			if (mantissa) digits++;
+		} else {
+			exponent++;
+			inexact = 1;
+		}
+	}
+	int whole = q - p;
+	p = q;
+	if ((p < end) && (*p == '.')) {
+		for (q = ++p; (q < end) && (*q >= '0') && (*q <= '9'); q++) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*q - '0');
+				if (mantissa) digits++;
+				exponent--;
+			} else {
+				inexact = 1;
+			}
+		}
+		if ((whole == 0) && (q == p)) parse_error(chunk, start, "expected a number");
+		p = q;
+	} else if (whole == 0) {
+		parse_error(chunk, start, "expected a number");
+	}
+	if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+		q = p + 1;
+		if ((q < end) && ((*q == '-') || (*q == '+'))) expsign = (*q++ == '-') ? -1 : 1;
+		if ((q == end) || (*q < '0') || (*q > '9')) parse_error(chunk, start, "bad exponent");
+		for (; (q < end) && (*q >= '0') && (*q <= '9'); q++) {
+			if (e < 100000) e = e * 10 + (*q - '0');
+		}
+		exponent += expsign * e;
+		p = q;
+	}
+
+	if (!inexact && (mantissa <= FP_MANTISSA_MAX) && (exponent >= -FP_EXACT_POW10) && (exponent <= FP_EXACT_POW10)) {
+		fp_type value = (fp_type) mantissa;
+		if (exponent < 0) value /= pow10_exact[-exponent];
+		else value *= pow10_exact[exponent];
+		*out = negative ? -value : value;
+		return p;
+	}
+
+	// The slow way. Numbers are never this long in practice.
+	char buf[64];
+	if (p - start >= (long) sizeof(buf)) parse_error(chunk, start, "number too long");
+	memcpy(buf, start, p - start);
+	buf[p - start] = 0;
+	*out = strto_fp(buf, NULL);
+	return p;
+}
+
+
+/* Work out which opcode name is at p, by first letter and length. */
+static const char *parse_opcode(parse_chunk *chunk, const char *p, enum opcode *out) {
+	const char *end = chunk->end;
+	const char *q;
+	int n;
+
+	p = skip_spaces(p, end);
+	for (q = p; (q < end) && (((*q >= 'a') && (*q <= 'z')) || (*q == '-')); q++);
+	n = q - p;
+	switch (n ? p[0] : 0) {
+		case 'a':
+			if ((n == 3) && (p[1] == 'd') && (p[2] == 'd')) { *out = ADD; return q; }
+			break;
+		case 'c':
+			if ((n == 5) && (memcmp(p, "const", 5) == 0)) { *out = CONST; return q; }
+			break;
+		case 'm':
+			if (n != 3) break;
+			if ((p[1] == 'u') && (p[2] == 'l')) { *out = MUL; return q; }
+			if ((p[1] == 'a') && (p[2] == 'x')) { *out = MAX; return q; }
+			if ((p[1] == 'i') && (p[2] == 'n')) { *out = MIN; return q; }
+			break;
+		case 'n':
+			if ((n == 3) && (p[1] == 'e') && (p[2] == 'g')) { *out = NEG; return q; }
+			break;
+		case 's':
+			if ((n == 3) && (p[1] == 'u') && (p[2] == 'b')) { *out = SUB; return q; }
+			if ((n == 4) && (memcmp(p, "sqrt", 4) == 0)) { *out = SQRT; return q; }
+			if ((n == 6) && (memcmp(p, "square", 6) == 0)) { *out = SQUARE; return q; }
+			break;
+		case 'v':
+			if ((n == 5) && (memcmp(p, "var-x", 5) == 0)) { *out = VAR_X; return q; }
+			if ((n == 5) && (memcmp(p, "var-y", 5) == 0)) { *out = VAR_Y; return q; }
+			break;
+	}
+	parse_error(chunk, p, "unknown opcode");
+	return q;
+}
+
+
+/* Parse every line in the chunk. Comments start with #, and blank lines are fine. 
+ * The first thing wrong ends up in chunk->error. */
+static void *parse_thread(void *args) {
+	parse_chunk *chunk = (parse_chunk *) args;
+	const char *p = chunk->start;
+	const char *end = chunk->end;
+
+	chunk->error[0] = 0;
+	if (setjmp(chunk->bail)) return (void *)0;
+	while (p < end) {
+		p = skip_spaces(p, end);
+		if (p == end) break;
+		if (*p == '\n') {
+			p++;
+			continue;
+		}
+		if (*p == '#') {
+			while ((p < end) && (*p != '\n')) p++;
+			continue;
+		}
+
+		if (chunk->size == chunk->capacity) {
+			chunk->capacity *= 2;
+			chunk->ops = (operation *) realloc(chunk->ops, sizeof(operation) * chunk->capacity);
+			if (!chunk->ops) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(1);
+			}
+		}
+		operation *op = chunk->ops + chunk->size;
+
+		p = parse_id(chunk, p, &op->line);
+		p = parse_opcode(chunk, p, &op->code);
+		switch (op->code) {
+			case VAR_X:
+			case VAR_Y:
+				break;
+			case CONST:
+				p = parse_number(chunk, p, &op->value);
+				break;
+			case NEG:
+			case SQUARE:
+			case SQRT:
+				p = parse_id(chunk, p, &op->a);
+				break;
+			case ADD:
+			case SUB:
+			case MUL:
+			case MAX:
+			case MIN:
+				p = parse_id(chunk, p, &op->a);
+				p = parse_id(chunk, p, &op->b);
+				break;
+			default:
+				// parse_opcode never comes up with the fused ones.
+				break;
+		}
+		p = skip_spaces(p, end);
+		if ((p < end) && (*p != '\n')) parse_error(chunk, p, "unexpected text at end of line");
+
+		if (op->line >= chunk->slots) chunk->slots = op->line + 1;
+		chunk->size++;
+	}
+	return (void *)0;
+}
+
+
+/* Where the nth instruction in the file starts, counting from 0 and skipping comments 
+ * and blank lines the way parse_thread does. */
+static const char *find_instruction(const char *file, const char *end, int n) {
+	const char *p = file;
+	while (p < end) {
+		p = skip_spaces(p, end);
+		if ((p < end) && (*p != '\n') && (*p != '#') && (n-- == 0)) return p;
+		while ((p < end) && (*p != '\n')) p++;
+		if (p < end) p++;
+	}
+	return end;
+}
+
+
+/* Make sure every operand names something from an earlier line, so nothing downstream
+ * reads a slot that was never written, or one past the end. The chunks can't tell on
+ * their own, not knowing what came before them.
+ * Returns the index of the first instruction that doesn't, or -1 if they all do. */
+static int check_operands(const func *f) {
+	unsigned char *defined = (unsigned char *) calloc(f->slots, 1);
+	int i, bad = -1;
+	if (!defined) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (i = 0; (i < f->size) && (bad < 0); i++) {
+		const operation *op = f->func + i;
+		switch (op->code) {
+			case ADD:
+			case SUB:
+			case MUL:
+			case MAX:
+			case MIN:
+				if ((op->b >= f->slots) || !defined[op->b]) bad = i;
+				// fall through
+			case NEG:
+			case SQUARE:
+			case SQRT:
+				if ((op->a >= f->slots) || !defined[op->a]) bad = i;
+				break;
+			default:
+				break;
+		}
+		defined[op->line] = 1;
+	}
+	free(defined);
+	return bad;
+}
+
+
+/* Opens filename and parses instructions into out. Anything wrong with the file goes
+ * in error, at most errsize bytes of it, and nothing is left for the caller to free.
+ * Returns 1 if it parsed, 0 if not. Caller must free out->func */
+int parse_func(const char *filename, func *out, char *error, int errsize) {
+	func ret;
+	ret.size = 0;
+	ret.slots = 0;
+	ret.jit = (jit_code *)0;
+	ret.packed = (packed_op *)0;
+	ret.pool = (fp_type *)0;
+	ret.mapping = (void *)0;
+	ret.mapsize = 0;
+	ret.xops = 0;
+	ret.yops = 0;
+	ret.sorted = (func *)0;
+	struct stat st;
+	const char *file = "";
+	int i, nthreads = 1;
+
+	int fd = open(filename, O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		if (fd >= 0) close(fd);
+		snprintf(error, errsize, "%s: file opening failed", filename);
+		return 0;
+	}
+	if (st.st_size > 0) {
+		file = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file == (const char *) MAP_FAILED) {
+			close(fd);
+			snprintf(error, errsize, "Unable to map %s", filename);
+			return 0;
+		}
+		madvise((void *) file, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	// Small files aren't worth the threads.
+	if (PARSE_THREADS > 1) {
+		nthreads = st.st_size / PARSE_CHUNK;
+		if (nthreads > PARSE_THREADS) nthreads = PARSE_THREADS;
+		if (nthreads < 1) nthreads = 1;
+	}
+
+	parse_chunk chunks[PARSE_THREADS > 1 ? PARSE_THREADS : 1];
+	pthread_t threads[PARSE_THREADS > 1 ? PARSE_THREADS : 1];
+	const char *start = file;
+	for (i = 0; i < nthreads; i++) {
+		const char *cut = file + (st.st_size * (i + 1)) / nthreads;
+		if (i == nthreads - 1) cut = file + st.st_size;
+		if (cut < start) cut = start;
+		while ((cut < file + st.st_size) && (cut[-1] != '\n')) cut++;
+
+		chunks[i].filename = filename;
+		chunks[i].file = file;
+		chunks[i].start = start;
+		chunks[i].end = cut;
+		chunks[i].size = 0;
+		chunks[i].slots = 0;
+		// About 20 bytes a line, and it doubles if that was wrong.
+		chunks[i].capacity = (cut - start) / 16 + 16;
+		chunks[i].ops = (operation *) malloc(sizeof(operation) * chunks[i].capacity);
+		if (!chunks[i].ops) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		start = cut;
+	}
+
+	if (nthreads == 1) {
+		parse_thread(chunks);
+	} else {
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(threads + i, NULL, parse_thread, chunks + i)) {
+				fprintf(stderr, "Problem creating thread\n");
+				exit(1);
+			}
+		}
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_join(threads[i], NULL)) {
+				fprintf(stderr, "Problem joining threads\n");
+				exit(1);
+			}
+		}
+	}
+
+	// The first chunk to go wrong has the earliest line in the file that did.
+	for (i = 0; i < nthreads; i++) {
+		if (chunks[i].error[0]) break;
+	}
+	if (i < nthreads) {
+		snprintf(error, errsize, "%s", chunks[i].error);
+		for (i = 0; i < nthreads; i++) free(chunks[i].ops);
+		if (st.st_size > 0) munmap((void *) file, st.st_size);
+		return 0;
+	}
+
+	// Stitch the chunks back together in order.
+	if (nthreads == 1) {
+		ret.func = chunks[0].ops;
+		ret.size = chunks[0].size;
+		ret.slots = chunks[0].slots;
+	} else {
+		long total = 0;
+		for (i = 0; i < nthreads; i++) total += chunks[i].size;
+		ret.func = (operation *) malloc(sizeof(operation) * (total + 1));
+		if (!ret.func) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(1);
+		}
+		for (i = 0; i < nthreads; i++) {
+			memcpy(ret.func + ret.size, chunks[i].ops, sizeof(operation) * chunks[i].size);
+			ret.size += chunks[i].size;
+			if (chunks[i].slots > ret.slots) ret.slots = chunks[i].slots;
+			free(chunks[i].ops);
+		}
+	}
+
+	if (ret.size == 0) {
+		free(ret.func);
+		if (st.st_size > 0) munmap((void *) file, st.st_size);
+		snprintf(error, errsize, "%s: no instructions", filename);
+		return 0;
+	}
+	i = check_operands(&ret);
+	if (i >= 0) {
+		describe_line(error, errsize, filename, file, file + st.st_size, find_instruction(file, file + st.st_size, i),
+				"operand not defined on an earlier line");
+		free(ret.func);
+		munmap((void *) file, st.st_size);
+		return 0;
+	}
+	if (st.st_size > 0) munmap((void *) file, st.st_size);
+	*out = ret;
+	return 1;
+}
+
+
+/* parse_func, for when there's no going on without it. Reports what's wrong with the
+ * file and quits. Caller must free func.func */
+func parse_file(const char *filename) {
+	char error[PARSE_ERROR_SIZE];
+	func ret;
+	if (!parse_func(filename, &ret, error, sizeof(error))) {
+		fprintf(stderr, "%s\n", error);
+		exit(1);
+	}
+	return ret;
+}
@@ -0,0 +1,203 @@
+/*
+ * profile.c
+ *
+ * Where the time goes, with PROFILE on. Each worker keeps a profile of its own in its
+ * scratchpad: how long it spent on tiles, how many intervals and blocks it evaluated,
+ * every instruction those blocks ran, and with PROFILE_PERF, what the CPU's own
+ * counters saw while it was in render_chunk. The renderer adds up how long its jobs
+ * took, so busy time against that shows who sat around waiting. With PROFILE off
+ * every call in here is behind an if that the compiler throws away.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if PROFILE_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+static const char *opcode_names[PACKED_END] = {
+	[VAR_X] = "var-x", [VAR_Y] = "var-y", [CONST] = "const",
+	[ADD] = "add", [SUB] = "sub", [MUL] = "mul", [MAX] = "max", [MIN] = "min",
+	[NEG] = "neg", [SQUARE] = "square", [SQRT] = "sqrt",
+	[HYPOT] = "hypot", [MAX_NEG] = "max-neg", [MIN_NEG] = "min-neg",
+	[ADD_IMM] = "add-imm", [SUB_IMM] = "sub-imm", [IMM_SUB] = "imm-sub",
+	[MUL_IMM] = "mul-imm", [MAX_IMM] = "max-imm", [MIN_IMM] = "min-imm"
+};
+
+static const char *counter_names[PERF_COUNTERS] = {"cycles", "L1d misses", "LLC misses", "branch misses"};
+
+
+/* Seconds on the monotonic clock. */
+double profile_clock(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+
+/* Start a profile out empty, with no counters open yet. */
+void profile_init(profile *p) {
+	memset(p, 0, sizeof(profile));
+	for (int i = 0; i < PERF_COUNTERS; i++) p->perf_fd[i] = -1;
+}
+
+
+/* Close the counters of a profile. */
+void profile_free(profile *p) {
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (p->perf_fd[i] >= 0) close(p->perf_fd[i]);
+		p->perf_fd[i] = -1;
+	}
+}
+
+
+/* One more block of n points through sdf: count every instruction in it. */
+void profile_tape(profile *p, const func *sdf, int n) {
+	p->blocks++;
+	p->points += n;
+	for (int i = 0; i < sdf->size; i++) p->ops[sdf->func[i].code]++;
+}
+
+
+#if PROFILE_PERF
+// Hardware counters as perf_event_open wants them, in the order of counter_names
+static const uint32_t counter_types[PERF_COUNTERS] = {
+	PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+};
+static const uint64_t counter_configs[PERF_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+
+/* Open the counters for the calling thread, all in one group under the first that
+ * opens, so they start and stop together. Any the machine doesn't have stay closed. */
+static void open_counters(profile *p) {
+	int leader = -1;
+	p->perf_open = 1;
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counter_types[i];
+		attr.config = counter_configs[i];
+		attr.disabled = (leader < 0);
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		p->perf_fd[i] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+		if ((leader < 0) && (p->perf_fd[i] >= 0)) leader = p->perf_fd[i];
+	}
+	p->perf_leader = leader;
+}
+#endif
+
+
+/* Start the counters, around a call to render_chunk on the worker that owns p. */
+void profile_start(profile *p) {
+#if PROFILE_PERF
+	if (!p->perf_open) open_counters(p);
+	if (p->perf_leader >= 0) ioctl(p->perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+	(void) p;
+#endif
+}
+
+
+/* Stop them again, and take down what they've counted so far. */
+void profile_stop(profile *p) {
+#if PROFILE_PERF
+	uint64_t values[PERF_COUNTERS + 1];
+	if (p->perf_leader < 0) return;
+	ioctl(p->perf_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	if (read(p->perf_leader, values, sizeof(values)) <= 0) return;
+	// The group reads back as how many, then each open one in the order it opened.
+	for (int i = 0, k = 1; (i < PERF_COUNTERS) && (k <= (int) values[0]); i++) {
+		if (p->perf_fd[i] >= 0) p->counts[i] = values[k++];
+	}
+#else
+	(void) p;
+#endif
+}
+
+
+/* Print what every worker of r got up to. */
+void print_profile(renderer *r) {
+	profile total;
+	int i, j;
+	profile_init(&total);
+
+	printf("\nProfile: %.3f s wall in jobs\n", r->wall);
+	printf("thread   busy s  idle %%  tiles  intervals     blocks");
+	if (PROFILE_PERF) for (j = 0; j < PERF_COUNTERS; j++) printf(" %14s", counter_names[j]);
+	printf("\n");
+	for (i = 0; i < r->num_workers; i++) {
+		profile *p = &r->workers[i].prof;
+		printf("%6d %8.3f %7.1f %6ld %10ld %10ld", i, p->busy, r->wall > 0 ? 100.0 * (1.0 - (p->busy / r->wall)) : 0.0,
+				p->tiles, p->intervals, p->blocks);
+		if (PROFILE_PERF) {
+			for (j = 0; j < PERF_COUNTERS; j++) {
+				if (p->perf_fd[j] >= 0) printf(" %14llu", (unsigned long long) p->counts[j]);
+				else printf(" %14s", "-");
+			}
+		}
+		printf("\n");
+		total.busy += p->busy;
+		total.points += p->points;
+		for (j = 0; j < PACKED_END; j++) total.ops[j] += p->ops[j];
+	}
+	if (PROFILE_PERF && (r->workers[0].prof.perf_leader < 0) && r->workers[0].prof.perf_open) {
+		printf("(no perf counters here, perf_event_open said no)\n");
+	}
+
+	long all = 0;
+	for (j = 0; j < PACKED_END; j++) all += total.ops[j];
+	printf("Instructions run, a block of up to %d points each, %ld points in all:\n", BLOCK_SIZE, total.points);
+	for (j = 0; j < PACKED_END; j++) {
+		if (total.ops[j]) printf("  %-8s %12ld  %5.1f%%\n", opcode_names[j], total.ops[j], 100.0 * total.ops[j] / all);
+	}
+}
+
+
+/* Forget everything the workers of r have counted, but the hardware counters, which
+ * only ever go up. */
+void reset_profile(renderer *r) {
+	r->wall = 0;
+	for (int i = 0; i < r->num_workers; i++) {
+		profile *p = &r->workers[i].prof;
+		p->busy = 0;
+		p->tiles = p->intervals = p->blocks = p->points = 0;
+		memset(p->ops, 0, sizeof(p->ops));
+	}
+}
+
+
+/* Write the time every tile took as an across by down grayscale pgm, a pixel a tile,
+ * white for the slowest. */
+int write_heatmap(const char *filename, const float *heat, int across, int down) {
+	float most = 0;
+	long n = (long) across * down;
+	for (long i = 0; i < n; i++) if (heat[i] > most) most = heat[i];
+	unsigned char *gray = (unsigned char *) malloc(n);
+	if (!gray) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (long i = 0; i < n; i++) gray[i] = (most > 0) ? (unsigned char) (255.0f * heat[i] / most + 0.5f) : 0;
+	int ok = write_ppm(filename, (char *) gray, across, down);
+	free(gray);
+	return ok;
+}
@@ -0,0 +1,414 @@
+/*
+ * server.c
+ *
+ * A render server, for when starting machine up for every image costs more than the
+ * image does. It listens on a Unix domain socket and keeps everything it can between
+ * requests: the renderer and its threads, the compiled tapes of the last few .vm files
+ * it was asked for, and the last lot of tiles it rendered, so a view it has seen
+ * before, or one that overlaps it, only renders what's new.
+ *
+ * Requests are a line of text, and so are the answers, except for the image:
+ *
+ *   RENDER file x y scale width height [double|float|mixed]
+ *     OK bytes ms, then bytes of PBM image
+ *   STATS
+ *     OK requests ... on one line
+ *   QUIT
+ *     OK, and the server stops
+ *
+ * Anything wrong with a request gets ERR and the reason instead.
+ *
+ * Simeon Veldstra, 2025
+ *
+ */
+
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE / 8)
+// Farthest from the origin a view can start, in pixels, with every pixel's coordinates
+// and every tile's index still exact
+#define GRID_MAX 4503599627370496.0
+
+// What a tile was rendered from. Zeroed before it's filled in, so memcmp works.
+typedef struct {
+	uint64_t tape;		// hash of the .vm
+	uint64_t step;		// bits of the pixel size
+	int64_t tx, ty;		// which tile, counting from the origin
+	int32_t precision;
+} tile_key;
+
+// A rendered tile, on the LRU list and in a hash chain
+typedef struct {
+	tile_key key;
+	int prev, next;
+	int chain;
+	unsigned char bits[TILE_BYTES];
+} tile_entry;
+
+typedef struct {
+	uint64_t hash;
+	func *sdf;
+	long used;
+} tape_entry;
+
+typedef struct {
+	renderer *r;
+	tape_entry tapes[SERVER_TAPES];
+	tile_entry *tiles;
+	int *buckets;
+	int head, tail, count;		// LRU list, most recently used at head
+	long clock;
+	long requests, tape_hits, tape_misses, tile_hits, tile_misses;
+	double total_ms, max_ms, last_ms;
+} server;
+
+
+static uint64_t key_hash(const tile_key *key) {
+	const unsigned char *p = (const unsigned char *) key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < sizeof(tile_key); i++) hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+
+static void lru_unlink(server *sv, int i) {
+	tile_entry *e = sv->tiles + i;
+	if (e->prev >= 0) sv->tiles[e->prev].next = e->next;
+	else sv->head = e->next;
+	if (e->next >= 0) sv->tiles[e->next].prev = e->prev;
+	else sv->tail = e->prev;
+}
+
+
+static void lru_push(server *sv, int i) {
+	tile_entry *e = sv->tiles + i;
+	e->prev = -1;
+	e->next = sv->head;
+	if (sv->head >= 0) sv->tiles[sv->head].prev = i;
+	sv->head = i;
+	if (sv->tail < 0) sv->tail = i;
+}
+
+
+/* The cached tile for key, moved to the front, or null. */
+static tile_entry *find_tile(server *sv, const tile_key *key) {
+	for (int i = sv->buckets[key_hash(key) % (2 * SERVER_TILES)]; i >= 0; i = sv->tiles[i].chain) {
+		if (memcmp(&sv->tiles[i].key, key, sizeof(tile_key)) == 0) {
+			lru_unlink(sv, i);
+			lru_push(sv, i);
+			return sv->tiles + i;
+		}
+	}
+	return (tile_entry *)0;
+}
+
+
+/* Somewhere to keep a tile for key, the least recently used one if it's full up. */
+static tile_entry *add_tile(server *sv, const tile_key *key) {
+	int i;
+	if (sv->count < SERVER_TILES) {
+		i = sv->count++;
+	} else {
+		i = sv->tail;
+		lru_unlink(sv, i);
+		int *link = sv->buckets + (key_hash(&sv->tiles[i].key) % (2 * SERVER_TILES));
+		while (*link != i) link = &sv->tiles[*link].chain;
+		*link = sv->tiles[i].chain;
+	}
+	int *bucket = sv->buckets + (key_hash(key) % (2 * SERVER_TILES));
+	sv->tiles[i].key = *key;
+	sv->tiles[i].chain = *bucket;
+	*bucket = i;
+	lru_push(sv, i);
+	return sv->tiles + i;
+}
+
+
+/* The compiled function for filename, from the cache if its contents have been seen
+ * lately, otherwise loaded in place of the one used longest ago. Returns 0, with the
+ * reason in error, if the file won't load. */
+static func *find_tape(server *sv, const char *filename, uint64_t *hash, char *error, int errsize) {
+	int oldest = 0;
+	if (!hash_file(filename, hash)) {
+		snprintf(error, errsize, "can't read %.256s, or it isn't a file", filename);
+		return (func *)0;
+	}
+	sv->clock++;
+	for (int i = 0; i < SERVER_TAPES; i++) {
+		tape_entry *t = sv->tapes + i;
+		if (t->sdf && (t->hash == *hash)) {
+			t->used = sv->clock;
+			sv->tape_hits++;
+			return t->sdf;
+		}
+		if (!t->sdf || (sv->tapes[oldest].sdf && (t->used < sv->tapes[oldest].used))) oldest = i;
+	}
+	func *sdf = try_load_func(filename, 0, error, errsize);
+	if (!sdf) return (func *)0;
+	tape_entry *t = sv->tapes + oldest;
+	if (t->sdf) free_func(t->sdf);
+	t->sdf = sdf;
+	t->hash = *hash;
+	t->used = sv->clock;
+	sv->tape_misses++;
+	return t->sdf;
+}
+
+
+/* Whether v is a number. -Ofast lets the compiler assume NaN and infinity never turn
+ * up, so isfinite can't be trusted to look, and this goes by the exponent bits. */
+static int is_number(double v) {
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return ((bits >> 52) & 0x7ff) != 0x7ff;
+}
+
+
+/* Whether view at width by height lands on the pixel grid render_cached cuts tiles
+ * from, somewhere it can say exactly which tiles. Anything else would come out of
+ * lround as whatever it likes, and be served tiles from some other view. */
+static int on_grid(const viewport *view, int width, int height) {
+	if (!is_number(view->x) || !is_number(view->y) || !is_number(view->scale)) return 0;
+	double step = (2.0 * view->scale) / width;
+	if (!is_number(step) || !(step > 0)) return 0;
+	double gx = (view->x - view->scale) / step;
+	double gy = -(view->y + (step * height / 2)) / step;
+	return is_number(gx) && is_number(gy) && (fabs(gx) <= GRID_MAX) && (fabs(gy) <= GRID_MAX);
+}
+
+
+/* Render view into bits, a mask like render_mask's, out of cached tiles where there
+ * are any. For tiles to be any use to another view, they have to sit on the same
+ * pixels, so the pixels are put on a grid through the origin, the view snapped to
+ * the nearest one, and the tiles cut from that grid rather than from the corner of
+ * the image. Each pixel's coordinates are worked out from where it is on the grid,
+ * never added up along the row, so a tile comes out the same from any view. */
+static void render_cached(server *sv, func *sdf, uint64_t hash, const viewport *view, int width, int height, int precision, unsigned char *bits) {
+	fp_type step = (2.0 * view->scale) / width;
+	long gx = lround((view->x - view->scale) / step);
+	long gy = lround(-(view->y + (step * height / 2)) / step);
+	long tx0 = (long) floor((double) gx / TILE_SIZE);
+	long ty0 = (long) floor((double) gy / TILE_SIZE);
+	int across = (int) ((long) floor((double) (gx + width - 1) / TILE_SIZE) - tx0 + 1);
+	int down = (int) ((long) floor((double) (gy + height - 1) / TILE_SIZE) - ty0 + 1);
+	int cover_w = across * TILE_SIZE, cover_h = down * TILE_SIZE;
+	int stride = MASK_STRIDE(cover_w), i, j, row, n = 0;
+	tile_key key;
+
+	fp_type *xspace = (fp_type *) malloc(sizeof(fp_type) * (cover_w + 1));
+	fp_type *yspace = (fp_type *) malloc(sizeof(fp_type) * (cover_h + 1));
+	unsigned char *cover = (unsigned char *) malloc((long) stride * cover_h);
+	tile_entry **found = (tile_entry **) malloc(sizeof(tile_entry *) * across * down);
+	int *missing = (int *) malloc(sizeof(int) * across * down);
+	char *line = (char *) malloc(cover_w);
+	if (!(xspace && yspace && cover && found && missing && line)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (i = 0; i <= cover_w; i++) xspace[i] = (fp_type) ((tx0 * TILE_SIZE) + i) * step;
+	for (i = 0; i <= cover_h; i++) yspace[i] = -((fp_type) ((ty0 * TILE_SIZE) + i) * step);
+
+	memset(&key, 0, sizeof(key));
+	key.tape = hash;
+	double exact = step;
+	memcpy(&key.step, &exact, sizeof(key.step));
+	key.precision = precision;
+	for (j = 0; j < down; j++) {
+		for (i = 0; i < across; i++) {
+			key.tx = tx0 + i;
+			key.ty = ty0 + j;
+			found[(j * across) + i] = find_tile(sv, &key);
+			if (!found[(j * across) + i]) missing[n++] = (j * across) + i;
+		}
+	}
+	sv->tile_hits += (across * down) - n;
+	sv->tile_misses += n;
+
+	if (n) render_tile_set(sv->r, sdf, xspace, yspace, cover_w, cover_h, precision, cover, missing, n);
+
+	// Cached tiles into the cover, then new ones into the cache, in that order, since 
+	// making room for the new ones could throw out one of the old.
+	for (int pass = 0; pass < 2; pass++) {
+		for (j = 0; j < down; j++) {
+			for (i = 0; i < across; i++) {
+				tile_entry *e = found[(j * across) + i];
+				unsigned char *corner = cover + ((long) j * TILE_SIZE * stride) + (i * TILE_SIZE / 8);
+				if (e && !pass) {
+					for (row = 0; row < TILE_SIZE; row++) memcpy(corner + ((long) row * stride), e->bits + (row * TILE_SIZE / 8), TILE_SIZE / 8);
+				} else if (!e && pass) {
+					key.tx = tx0 + i;
+					key.ty = ty0 + j;
+					e = add_tile(sv, &key);
+					for (row = 0; row < TILE_SIZE; row++) memcpy(e->bits + (row * TILE_SIZE / 8), corner + ((long) row * stride), TILE_SIZE / 8);
+				}
+			}
+		}
+	}
+
+	// And the view out of the cover, which needn't start on a byte.
+	int left = (int) (gx - (tx0 * TILE_SIZE)), top = (int) (gy - (ty0 * TILE_SIZE));
+	for (row = 0; row < height; row++) {
+		unpack_mask_row(cover + ((long) (top + row) * stride), cover_w, line);
+		pack_mask_row(line + left, width, bits + ((long) row * MASK_STRIDE(width)));
+	}
+
+	free(xspace);
+	free(yspace);
+	free(cover);
+	free(found);
+	free(missing);
+	free(line);
+}
+
+
+/* Answer one RENDER request, line being what came after the word. */
+static void handle_render(server *sv, const char *line, FILE *out) {
+	char filename[4096], name[16] = "double";
+	viewport view;
+	double x, y, scale;
+	int width, height, precision = PRECISION_DOUBLE;
+	struct timespec start, end;
+	uint64_t hash;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int got = sscanf(line, "%4095s %lf %lf %lf %d %d %15s", filename, &x, &y, &scale, &width, &height, name);
+	if (got < 6) {
+		fprintf(out, "ERR usage: RENDER file x y scale width height [double|float|mixed]\n");
+		return;
+	}
+	view.x = x;
+	view.y = y;
+	view.scale = scale;
+	if (strcmp(name, "float") == 0) precision = PRECISION_FLOAT;
+	else if (strcmp(name, "mixed") == 0) precision = PRECISION_MIXED;
+	else if (strcmp(name, "double") != 0) {
+		fprintf(out, "ERR unknown precision %s\n", name);
+		return;
+	}
+	if ((width < 1) || (height < 1) || (width > SERVER_MAX_SIZE) || (height > SERVER_MAX_SIZE) || !(view.scale > 0)) {
+		fprintf(out, "ERR size must be 1 to %d and scale positive\n", SERVER_MAX_SIZE);
+		return;
+	}
+	if (!on_grid(&view, width, height)) {
+		fprintf(out, "ERR x, y and scale must be numbers, and not too far out for the scale\n");
+		return;
+	}
+
+	long misses = sv->tile_misses, hits = sv->tile_hits;
+	char error[PARSE_ERROR_SIZE];
+	func *sdf = find_tape(sv, filename, &hash, error, sizeof(error));
+	if (!sdf) {
+		fprintf(out, "ERR %s\n", error);
+		return;
+	}
+	char header[64];
+	int header_size = snprintf(header, sizeof(header), "P4\n%d %d\n", width, height);
+	long size = (long) MASK_STRIDE(width) * height;
+	unsigned char *bits = (unsigned char *) malloc(size);
+	if (!bits) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	render_cached(sv, sdf, hash, &view, width, height, precision, bits);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ms = ((end.tv_sec - start.tv_sec) * 1000.0) + ((end.tv_nsec - start.tv_nsec) / 1000000.0);
+	sv->requests++;
+	sv->total_ms += ms;
+	sv->last_ms = ms;
+	if (ms > sv->max_ms) sv->max_ms = ms;
+	printf("%s %dx%d at %g, %g scale %g: %ld of %ld tiles cached, %.2f ms\n", filename, width, height, view.x, view.y, view.scale,
+			sv->tile_hits - hits, (sv->tile_hits - hits) + (sv->tile_misses - misses), ms);
+	fflush(stdout);
+
+	fprintf(out, "OK %ld %.3f\n", header_size + size, ms);
+	fwrite(header, header_size, 1, out);
+	fwrite(bits, size, 1, out);
+	free(bits);
+}
+
+
+/* Listen on a Unix domain socket at path, and answer requests on it one connection at
+ * a time, rendering with num_threads threads, until somebody says QUIT. */
+int serve(const char *path, int num_threads) {
+	struct sockaddr_un addr;
+	char line[8192];
+	server sv;
+
+	memset(&sv, 0, sizeof(sv));
+	sv.tiles = (tile_entry *) malloc(sizeof(tile_entry) * SERVER_TILES);
+	sv.buckets = (int *) malloc(sizeof(int) * 2 * SERVER_TILES);
+	if (!(sv.tiles && sv.buckets)) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	for (int i = 0; i < 2 * SERVER_TILES; i++) sv.buckets[i] = -1;
+	sv.head = sv.tail = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((fd < 0) || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 16)) {
+		fprintf(stderr, "Unable to listen on %s\n", path);
+		exit(1);
+	}
+	// A client that hangs up early shouldn't take the server with it.
+	signal(SIGPIPE, SIG_IGN);
+	sv.r = create_pinned_renderer(num_threads);
+	printf("Listening on %s\n", path);
+	fflush(stdout);
+
+	int quit = 0;
+	while (!quit) {
+		int conn = accept(fd, NULL, NULL);
+		if (conn < 0) continue;
+		FILE *in = fdopen(conn, "r");
+		FILE *out = fdopen(dup(conn), "w");
+		if (!(in && out)) {
+			fprintf(stderr, "Problem opening connection\n");
+			exit(1);
+		}
+		while (!quit && fgets(line, sizeof(line), in)) {
+			if (strncmp(line, "RENDER ", 7) == 0) {
+				handle_render(&sv, line + 7, out);
+			} else if (strncmp(line, "STATS", 5) == 0) {
+				fprintf(out, "OK requests %ld tapes_hit %ld tapes_missed %ld tiles_hit %ld tiles_missed %ld tiles_kept %d mean_ms %.3f max_ms %.3f last_ms %.3f\n",
+						sv.requests, sv.tape_hits, sv.tape_misses, sv.tile_hits, sv.tile_misses, sv.count,
+						sv.requests ? sv.total_ms / sv.requests : 0.0, sv.max_ms, sv.last_ms);
+			} else if (strncmp(line, "QUIT", 4) == 0) {
+				fprintf(out, "OK\n");
+				quit = 1;
+			} else {
+				fprintf(out, "ERR unknown request\n");
+			}
+			fflush(out);
+		}
+		fclose(in);
+		fclose(out);
+	}
+
+	close(fd);
+	unlink(path);
+	free_renderer(sv.r);
+	for (int i = 0; i < SERVER_TAPES; i++) if (sv.tapes[i].sdf) free_func(sv.tapes[i].sdf);
+	free(sv.tiles);
+	free(sv.buckets);
+	return 0;
+}